@@ -15,8 +15,10 @@ using namespace std;
 #include <time.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <errno.h>
 #include <openssl/md5.h>
+#include <zlib.h>
 #include <iostream>
 #include <fstream>
 #include <string>
@@ -24,6 +26,12 @@ using namespace std;
 
 #include <mutex>
 #include <list>
+#include <map>
+#include <chrono>
+#include <condition_variable>
+#include <random>
+#include <vector>
+#include <functional>
 
 #include <openssl/ssl.h>
 #include <openssl/x509.h>
@@ -32,14 +40,15 @@ using namespace std;
 #include "url2lfn.hh"
 #include "XcacheH.hh"
 #include "cacheFileOpr.hh"
-#include "XrdCl/XrdClURL.hh"
-#include "XrdCl/XrdClXRootDResponses.hh"
-#include "XrdCl/XrdClFile.hh"
+#include "freshnessTable.hh"
+#include "XcacheHLog.hh"
+#include "stagein.hh"
+#include "purgeExecutor.hh"
+#include "XcacheHTrace.hh"
+#include "boundedMap.hh"
 #include "XrdSys/XrdSysError.hh"
 #include "XrdPosix/XrdPosixXrootd.hh"
 
-static int XcacheH_DBG = 1;
-
 struct httpResp 
 {
     char *data;
@@ -50,112 +59,17 @@ XrdSysError* eDest;
 std::string myName;
 
 time_t cacheLifeTime;
-size_t cacheBlockSize;
-int xrdPort;
-std::string hostName;
-
-#define MAXSTAGINWORKERS 10
-int currStagingWorkers = 0;
-std::list<std::string> stageinList;
-std::mutex stageinMutex;
+int davPropfind;
+time_t propfindTTL;
+time_t redirectTTL;
+time_t goneTTL;
+time_t unreachableTTL;
+int refreshSwap;
+time_t refreshStale;
 
 std::string myX509proxyFile;
 std::string CApath;
 
-void addToStageinList(std::string myPfn)
-{
-    int inList = 0;
-    std::list<std::string>::iterator it;
-
-    std::lock_guard<std::mutex> guard(stageinMutex);
-    for (it = stageinList.begin(); it != stageinList.end(); ++it)
-    {
-        if (*it == myPfn)
-        {
-            inList = 1;
-            break;
-        }
-    }
-
-    std::string msg;
-    if (! inList) 
-    {
-        stageinList.push_back(myPfn); 
-        msg = myName + ": adding stagein request for " + myPfn;
-    }
-    else
-        msg = myName + ": reject stagein request for " + myPfn;
-
-    if (XcacheH_DBG == 1) eDest->Say(msg.c_str());
-}
-
-void sparseReading(std::string localUrl, size_t blockSize)
-{
-    int fd;
-    size_t offset;
-    uint32_t n = 1;
-    char buff[2];
-
-    offset = 0;
-    XrdCl::XRootDStatus myStatus;
-    XrdCl::ResponseHandler myRespHdler;
-
-    XrdCl::File myRmtFile;
-    myStatus = myRmtFile.Open(localUrl.c_str(), XrdCl::OpenFlags::Read, XrdCl::Access::None, uint16_t(0));
-    while (myStatus.status == 0 && n > 0)
-    {
-        myStatus = myRmtFile.Read(offset, 1, (void*)buff, n, uint16_t(0));
-        offset += blockSize;
-    }
-    myStatus = myRmtFile.Close(uint16_t(0));
-}
-
-void stageinWorker(std::string myPfn)
-{
-    std::string localUrl = "root://" + hostName + ":" + std::to_string(xrdPort) + "//" + myPfn;
-
-    // To do: check again if the file is fully cached.
-    std::string msg;
-    msg = myName + ": stagein now: " + myPfn;
-    if (XcacheH_DBG == 1) eDest->Say(msg.c_str());
-
-    sparseReading(localUrl, cacheBlockSize);
-
-    std::lock_guard<std::mutex> guard(stageinMutex);
-    currStagingWorkers--; 
-
-    msg = myName + ": stagein completed: " + myPfn;
-    if (XcacheH_DBG == 1) eDest->Say(msg.c_str());
-}
-
-void stageinOpr()
-{
-    while (! sleep(20))
-    {  // lock will be released when going out of the scope
-        std::lock_guard<std::mutex> guard(stageinMutex);
-
-        std::string msg = myName + ": stagein list snapshot: available workers: "
-                                 + std::to_string(MAXSTAGINWORKERS - currStagingWorkers) 
-                                 + ", list length: "
-                                 + std::to_string(stageinList.size());
-        if (XcacheH_DBG == 1) eDest->Say(msg.c_str());
-
-        for (int i = currStagingWorkers; i < MAXSTAGINWORKERS; i++)
-        {
-            if (stageinList.size() > 0)
-            {
-                currStagingWorkers++;
-                std::string url = stageinList.front();
-                stageinList.pop_front();
-                std::thread newStageinWorker(stageinWorker, url);
-                newStageinWorker.detach();
-            }
-            else
-                break;
-        }
-    }
-}    
-
 void XcacheHInit(XrdSysError* eDst,
                  const std::string Name, 
                  struct cacheOptions *cacheOpts)
@@ -164,13 +78,33 @@ void XcacheHInit(XrdSysError* eDst,
     myName = Name;
 
     cacheLifeTime = cacheOpts->lifeT;
-    cacheBlockSize = cacheOpts->blockSize;
-    xrdPort = cacheOpts->xrdPort;
-    hostName = cacheOpts->hostName;
+    davPropfind = cacheOpts->propfind;
+    propfindTTL = cacheOpts->propfindTTL;
+    redirectTTL = cacheOpts->redirectTTL;
+    goneTTL = cacheOpts->goneTTL;
+    unreachableTTL = cacheOpts->unreachableTTL;
+    refreshSwap = (cacheOpts->refreshMode == "swap"? 1 : 0);
+    refreshStale = cacheOpts->refreshStale;
+
+    int rc = freshTableInit(cacheLifeTime, cacheOpts->freshTableShm);
+    if (rc != 0)
+    {
+        std::string msg = myName + ": can not use shared freshness table " + cacheOpts->freshTableShm 
+                                 + ", errno " + std::to_string(-rc);
+        eDest->Say(msg.c_str());
+    }
+    rc = freshTableSnapshotInit(cacheOpts->freshSnapshot, cacheOpts->freshSnapshotInterval);
+    if (rc != 0)
+    {
+        std::string msg = myName + ": can not load freshness snapshot " + cacheOpts->freshSnapshot
+                                 + ", errno " + std::to_string(-rc);
+        eDest->Say(msg.c_str());
+    }
 
-    std::thread stageinThread(stageinOpr);
-    stageinThread.detach();
+    stageinInit(cacheOpts);
+    purgeInit(cacheOpts);
     curl_global_init(CURL_GLOBAL_ALL);
+    XcacheHTraceInit(cacheOpts->traceSample, cacheOpts->traceFile);
 
     if (getenv("X509_USER_PROXY") != NULL)
         myX509proxyFile = getenv("X509_USER_PROXY");
@@ -182,7 +116,10 @@ void XcacheHInit(XrdSysError* eDst,
     else
         CApath = "/etc/grid-security/certificates";
 
-    if (getenv("XcacheH_DBG") != NULL) XcacheH_DBG = atoi(getenv("XcacheH_DBG"));
+    // 0: errors only, 1: info (default), 2: debug
+    int logLevel = XCACHEH_LOG_INFO;
+    if (getenv("XcacheH_DBG") != NULL) logLevel = atoi(getenv("XcacheH_DBG"));
+    XcacheHLogInit(eDest, myName, logLevel);
 }
 
 // Return:
@@ -200,7 +137,6 @@ int loadFromUserX509Proxy(char* cert, char* key)
     {
         while (x509Proxy.good() && std::getline(x509Proxy, line))
         {
-            cout << line;
             if (inCert || line.find("--BEGIN CERTIFICATE--") != std::string::npos)
             {
                 inCert = 1;
@@ -249,7 +185,6 @@ CURLcode sslCtxCallBack(CURL *curl, void *sslctx, void *parm)
                 free(userX509key);
             if (! loadFromUserX509Proxy(userX509cert, userX509key))
                 return CURLE_SSL_CERTPROBLEM;
-            cout << userX509cert;
         }
         mycert = strdup(userX509cert);
         mykey = strdup(userX509key);
@@ -322,21 +257,373 @@ static size_t XcacheHRemoteStatCallback(void *contents,
     return realsize;
 }
 
+void curlUseX509(CURL *curl_handle)
+{
+    // this only work with libcurl/OpenSSL. CentOS 7 default is libcurl/NSS
+    //             // Untested:
+    //curl_easy_setopt(curl_handle, CURLOPT_SSL_CTX_FUNCTION, sslCtxCallBack);    
+
+    curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYHOST, 1L);
+
+    curl_easy_setopt(curl_handle, CURLOPT_SSLCERTTYPE, "PEM");
+    curl_easy_setopt(curl_handle, CURLOPT_SSLKEYTYPE, "PEM");
+
+    curl_easy_setopt(curl_handle, CURLOPT_SSLCERT, myX509proxyFile.c_str());
+    curl_easy_setopt(curl_handle, CURLOPT_SSLKEY, myX509proxyFile.c_str());
+    curl_easy_setopt(curl_handle, CURLOPT_CAINFO, myX509proxyFile.c_str());
+    curl_easy_setopt(curl_handle, CURLOPT_CAPATH, CApath.c_str());
+}
+
+// Set while this thread reads the cached copy through XrdPosix during a
+// check, so that the resulting pfn2lfn() doesn't check the file again.
+static thread_local int inCheck = 0;
+
+// Value of a header in the last response of the (redirected) chain, or "".
+static std::string httpHeader(const char *headers, const char *name)
+{
+    const char *c, *last = headers, *e;
+    std::string field = std::string("\n") + name + ":";
+
+    while ((c = strcasestr(last +1, "\nHTTP/")) != NULL) last = c;
+    c = strcasestr(last, field.c_str());
+    if (c == NULL) return "";
+
+    c += field.length();
+    while (*c == ' ' || *c == '\t') c++;
+    e = c;
+    while (*e != 0 && *e != '\r' && *e != '\n') e++;
+    return std::string(c, e - c);
+}
+
+#define SAMPLELEN 4096
+
+static size_t XcacheHSampleCallback(void *contents,
+                                    size_t size,
+                                    size_t nmemb,
+                                    void *userp)
+{
+    size_t realsize = size * nmemb;
+    struct httpResp *mem = (struct httpResp *)userp;
+
+    if (mem->size + realsize > SAMPLELEN) return 0;  // range ignored, abort
+    memcpy(&(mem->data[mem->size]), contents, realsize);
+    mem->size += realsize;
+    return realsize;
+}
+
+// Compare a few byte ranges of the origin with a fully cached copy.
+//
+// Return
+// 0: all samples match
+// 1: a sample differs
+// 2: can't tell
+static int sampleCompare(CURL *curl_handle, std::string myPfn, off_t size)
+{
+    char rmtBuff[SAMPLELEN], localBuff[SAMPLELEN];
+    struct httpResp chunk;
+    off_t offsets[2];
+    size_t len;
+    long httpCode;
+    CURLcode res;
+    int fd, i, rc = 0;
+
+    if (size <= 0 || cacheFileQuery(myPfn) <= 0) return 2;
+
+    inCheck = 1;
+    fd = XrdPosixXrootd::Open(myPfn.c_str(), O_RDONLY);
+    inCheck = 0;
+    if (fd < 0) return 2;
+
+    len = (size < SAMPLELEN? size : SAMPLELEN);
+    offsets[0] = size / 2 - len / 2;
+    offsets[1] = size - len;
+
+    curl_easy_setopt(curl_handle, CURLOPT_TIMECONDITION, CURL_TIMECOND_NONE);
+    curl_easy_setopt(curl_handle, CURLOPT_NOBODY, 0L);
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADER, 0L);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, XcacheHSampleCallback);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
+    for (i = 0; i < 2 && rc == 0; i++)
+    {
+        std::string range = std::to_string(offsets[i]) + "-" + std::to_string(offsets[i] + len -1);
+
+        chunk.data = rmtBuff;
+        chunk.size = 0;
+        httpCode = 0;
+        curl_easy_setopt(curl_handle, CURLOPT_RANGE, range.c_str());
+        res = curl_easy_perform(curl_handle);
+        XcacheHTraceCurl(curl_handle, "curl sample");
+        if (res == CURLE_OK)
+            curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &httpCode);
+
+        if (httpCode != 206 || chunk.size != len ||
+            XrdPosixXrootd::Pread(fd, localBuff, len, offsets[i]) != (ssize_t)len)
+            rc = 2;
+        else if (memcmp(rmtBuff, localBuff, len) != 0)
+            rc = 1;
+    }
+    XrdPosixXrootd::Close(fd);
+    return rc;
+}
+
+// The adler32 (8 hex digits) in a RFC 3230 Digest header, "" if none
+static std::string digestAdler32(const std::string digest)
+{
+    std::string lower = digest;
+    size_t i;
+
+    for (i = 0; i < lower.size(); i++) lower[i] = tolower(lower[i]);
+    i = lower.find("adler32=");
+    if (i == std::string::npos) return "";
+    lower = lower.substr(i + 8, lower.find_first_of(", \t", i + 8) - i - 8);
+    if (lower.size() > 8 || lower.find_first_not_of("0123456789abcdef") != std::string::npos) return "";
+    return std::string(8 - lower.size(), '0') + lower;
+}
+
+// Compare the adler32 of a fully cached copy with the one in the origin's
+// Digest header. The copy is read from the local disk on the open path,
+// with the url claimed, so only files up to ADLERMAXSIZE are read: a few
+// tens of msec, about what the HEAD costs.
+//
+// Return
+// 0: the checksums match
+// 1: they differ
+// 2: can't tell
+#define ADLERMAXSIZE (16LL*1024*1024)
+#define ADLERBUFFSIZE (256*1024)
+static int adlerCompare(std::string myPfn, off_t size, const std::string digest)
+{
+    std::string rmtSum = digestAdler32(digest);
+    std::vector<char> buff(ADLERBUFFSIZE);
+    char localSum[9];
+    uLong sum = adler32(0L, Z_NULL, 0);
+    off_t offset = 0;
+    ssize_t n = 0;
+    int fd;
+
+    if (rmtSum == "" || size <= 0 || size > ADLERMAXSIZE || cacheFileQuery(myPfn) <= 0) return 2;
+
+    inCheck = 1;
+    fd = XrdPosixXrootd::Open(myPfn.c_str(), O_RDONLY);
+    inCheck = 0;
+    if (fd < 0) return 2;
+
+    while (offset < size && (n = XrdPosixXrootd::Pread(fd, buff.data(), buff.size(), offset)) > 0)
+    {
+        sum = adler32(sum, (const Bytef *)buff.data(), n);
+        offset += n;
+    }
+    XrdPosixXrootd::Close(fd);
+    if (offset != size) return 2;
+
+    snprintf(localSum, sizeof(localSum), "%08lx", sum & 0xffffffffUL);
+    return (rmtSum != localSum? 1 : 0);
+}
+
+// A 200 to If-Modified-Since is not yet evidence of a change: some origins
+// (the .cvmfspublished below) ignore If-Modified-Since and send no
+// Last-Modified. Look for real evidence: Last-Modified, Content-Length vs.
+// the cached size, Digest (RFC 3230) or ETag vs. what was seen last time
+// this copy was checked, the adler32 of the cached copy vs. Digest, and
+// finally sampled byte ranges vs. the cached copy.
+//
+// Digest and ETag are kept in the entry only when this shows the cached
+// copy to be current, otherwise a later check would compare against the
+// validators of a version that was never cached.
+//
+// Return
+// 0: no evidence of change
+// 1: the file was changed
+static int NeedRefetch_HTTP_evidence(CURL *curl_handle, std::string myPfn, const char *headers,
+                                     time_t mTime, off_t cachedSize, struct freshEntry *entry)
+{
+    struct freshEntry last;
+    std::string value, etag, digest;
+    const char *why;
+    int rc, current = 0;
+
+    value = httpHeader(headers, "Last-Modified");
+    time_t lastModT = (value != ""? curl_getdate(value.c_str(), NULL) : -1);
+    value = httpHeader(headers, "Content-Length");
+    entry->size = (value != ""? atoll(value.c_str()) : -1);
+    etag = httpHeader(headers, "ETag");
+    digest = httpHeader(headers, "Digest");
+
+    // only comparable if seen after this copy was cached
+    int hasLast = (freshTableLast(myPfn, &last) == 0 && last.checkT >= mTime);
+
+    if (lastModT != -1)
+    {
+        rc = (lastModT > mTime? 1 : 0);
+        current = (rc == 0);
+        why = "Last-Modified";
+    }
+    else if (entry->size >= 0 && cachedSize >= 0 && entry->size != cachedSize)
+    {
+        rc = 1;
+        why = "Content-Length";
+    }
+    else if (hasLast && digest != "" && last.digest != "")
+    {
+        rc = (digest != last.digest? 1 : 0);
+        current = (rc == 0);
+        why = "Digest";
+    }
+    else if (hasLast && etag != "" && last.etag != "")
+    {
+        rc = (etag != last.etag? 1 : 0);
+        current = (rc == 0);
+        why = "ETag";
+    }
+    else if ((rc = adlerCompare(myPfn, cachedSize, digest)) != 2)
+    {
+        current = (rc == 0);
+        why = "adler32 of the cached copy";
+    }
+    else if ((rc = sampleCompare(curl_handle, myPfn, (entry->size >= 0? entry->size : cachedSize))) != 2)
+    {
+        current = (rc == 0);
+        why = "sampled bytes";
+    }
+    else
+    {
+        rc = 0;
+        why = "no evidence of change";
+    }
+
+    if (current)
+    {
+        entry->etag = etag;
+        entry->digest = digest;
+    }
+    if (lastModT != -1)
+    {
+        entry->loMod = lastModT -1;
+        entry->hiMod = lastModT;
+    }
+    else
+    {
+        entry->loMod = (rc == 0? 0 : mTime);
+        entry->hiMod = (rc == 0? mTime : entry->checkT);
+    }
+    XcacheHLogNum(XCACHEH_LOG_DBG, "HTTP 200 to If-Modified-Since, decided by %s: %d", why, rc, 0);
+    return rc;
+}
+
+// Where a url was last redirected to, so that the next check can go there
+// directly instead of following the redirects again.
+struct redirectEntry
+{
+    std::string location;
+    time_t expireT;
+};
+
+#define MAXREDIRECTS 100000
+std::map<std::string, struct redirectEntry> redirectCache;
+unsigned long redirectInserts = 0;
+std::mutex redirectMutex;
+
+// How long the redirects in a response chain may be reused: redirectTTL,
+// or less if the Cache-Control max-age or Expires of a redirect response
+// says so, 0 if one of them must not be reused.
+static time_t redirectLifetime(const char *headers)
+{
+    std::string all = headers, block, value;
+    std::list<std::string> blocks;
+    size_t i = 0, j;
+    time_t ttl = redirectTTL, t;
+
+    while ((j = all.find("\r\n\r\n", i)) != std::string::npos)
+    {
+        blocks.push_back("\n" + all.substr(i, j - i) + "\r\n");
+        i = j + 4;
+    }
+    if (! blocks.empty()) blocks.pop_back();  // the final response
+
+    while (! blocks.empty())
+    {
+        block = blocks.front();
+        blocks.pop_front();
+
+        value = httpHeader(block.c_str(), "Cache-Control");
+        if (strcasestr(value.c_str(), "no-store") || strcasestr(value.c_str(), "no-cache")) return 0;
+        if ((i = value.find("max-age=")) != std::string::npos)
+        {
+            t = atol(value.c_str() + i + 8);
+            if (t < ttl) ttl = t;
+        }
+        else if ((value = httpHeader(block.c_str(), "Expires")) != "")
+        {
+            t = curl_getdate(value.c_str(), NULL) - time(NULL);
+            if (t < ttl) ttl = (t > 0? t : 0);
+        }
+    }
+    return ttl;
+}
+
+static std::string redirectLookup(std::string myPfn)
+{
+    std::lock_guard<std::mutex> guard(redirectMutex);
+    std::map<std::string, struct redirectEntry>::iterator it = redirectCache.find(myPfn);
+
+    if (it == redirectCache.end()) return "";
+    if (it->second.expireT < time(NULL))
+    {
+        redirectCache.erase(it);
+        return "";
+    }
+    return it->second.location;
+}
+
+static void redirectRemember(std::string myPfn, std::string location, time_t ttl)
+{
+    std::lock_guard<std::mutex> guard(redirectMutex);
+
+    boundedMapPrune(redirectCache, MAXREDIRECTS, &redirectInserts,
+                    [](const struct redirectEntry &e) { return e.expireT; });
+    redirectCache[myPfn].location = location;
+    redirectCache[myPfn].expireT = time(NULL) + ttl;
+}
+
+static void redirectForget(std::string myPfn)
+{
+    std::lock_guard<std::mutex> guard(redirectMutex);
+    redirectCache.erase(myPfn);
+}
+
 #define NeedRefetch_HTTP NeedRefetch_HTTP_curl
 
 // Return
 // 0: data source hasn't changed yet.
 // 1: yes file need to be fetched again.
 // 2: checking was not successful.
+// 4: the file is gone at the origin (404 or 410).
 //
-int NeedRefetch_HTTP_curl(std::string myPfn, time_t mTime)
+// With 0 and 1, entry is filled with what was learned about the origin file.
+//
+// A url that was redirected is checked at the final location directly, as
+// long as the redirect may be reused. If that fails, the url is checked again
+// from the start.
+//
+int NeedRefetch_HTTP_curl(std::string myPfn, time_t mTime, off_t cachedSize, struct freshEntry *entry)
 {
-    char* rmturl = strdup(myPfn.c_str());
+    std::string location = redirectLookup(myPfn), newLocation;
+    time_t newLocationTTL = 0;
+    char* rmturl = strdup((location != ""? location : myPfn).c_str());
 
     struct httpResp chunk;
+    struct curl_slist *headers = NULL;
     CURL *curl_handle;
     CURLcode res;
 
+    entry->checkT = time(NULL);
+    entry->ttl = 0;
+    entry->gen = 0;
+    entry->size = -1;
+    entry->etag = entry->digest = "";
+
     chunk.data = (char*)malloc(1);  // will be grown as needed by the realloc above 
     chunk.size = 0;    // no data at this point  
        
@@ -357,6 +644,10 @@ int NeedRefetch_HTTP_curl(std::string myPfn, time_t mTime)
     // Header only, ask the server not to send body data
     curl_easy_setopt(curl_handle, CURLOPT_NOBODY, 1L);
 
+    // RFC 3230, a checksum to compare when there is no Last-Modified
+    headers = curl_slist_append(headers, "Want-Digest: adler32, md5");
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
+
     // Follow redirection
     curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
     curl_easy_setopt(curl_handle, CURLOPT_MAXREDIRS, 5L);
@@ -367,9 +658,11 @@ int NeedRefetch_HTTP_curl(std::string myPfn, time_t mTime)
 
     // try without X509
     res = curl_easy_perform(curl_handle);
+    XcacheHTraceCurl(curl_handle, "curl HEAD");
  
     // check for errors, set rc = 2: can not check
     int rc = 2;
+    long httpCode = 0;
     if (res == CURLE_OK)
     {
         if (strcasestr(chunk.data, "HTTP/1.1 403 Forbidden") != NULL)
@@ -377,22 +670,20 @@ int NeedRefetch_HTTP_curl(std::string myPfn, time_t mTime)
             free(chunk.data);
             chunk.data = (char*)malloc(1);
             chunk.size = 0; 
-            // this only work with libcurl/OpenSSL. CentOS 7 default is libcurl/NSS
-            //             // Untested:
-            //curl_easy_setopt(curl_handle, CURLOPT_SSL_CTX_FUNCTION, sslCtxCallBack);    
-
-            curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, 1L);
-            curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYHOST, 1L);
-
-            curl_easy_setopt(curl_handle, CURLOPT_SSLCERTTYPE, "PEM");
-            curl_easy_setopt(curl_handle, CURLOPT_SSLKEYTYPE, "PEM");
-
-            curl_easy_setopt(curl_handle, CURLOPT_SSLCERT, myX509proxyFile.c_str());
-            curl_easy_setopt(curl_handle, CURLOPT_SSLKEY, myX509proxyFile.c_str());
-            curl_easy_setopt(curl_handle, CURLOPT_CAINFO, myX509proxyFile.c_str());
-            curl_easy_setopt(curl_handle, CURLOPT_CAPATH, CApath.c_str());
+            curlUseX509(curl_handle);
 
             res = curl_easy_perform(curl_handle);
+            XcacheHTraceCurl(curl_handle, "curl HEAD x509");
+        }
+
+        long nRedirects = 0;
+        char *effectiveUrl = NULL;
+        if (res == CURLE_OK && location == "" &&
+            curl_easy_getinfo(curl_handle, CURLINFO_REDIRECT_COUNT, &nRedirects) == CURLE_OK && nRedirects > 0 &&
+            curl_easy_getinfo(curl_handle, CURLINFO_EFFECTIVE_URL, &effectiveUrl) == CURLE_OK && effectiveUrl != NULL)
+        {
+            newLocation = effectiveUrl;
+            newLocationTTL = redirectLifetime(chunk.data);
         }
 
         if (res == CURLE_OK) 
@@ -403,7 +694,7 @@ int NeedRefetch_HTTP_curl(std::string myPfn, time_t mTime)
             char *c = strcasestr(chunk.data, "HTTP/1.1 200 OK");
             if (c != NULL) 
             {
-                rc = 1;
+                rc = NeedRefetch_HTTP_evidence(curl_handle, myPfn, chunk.data, mTime, cachedSize, entry);
                 /* 
                  * Can't do the following - http://cvmfs.sdcc.bnl.gov:8000/cvmfs/atlas.sdcc.bnl.gov/.cvmfspublished
                  * will always return "HTTP/1.1 200 OK" with an "Expires: in the future, regardless of whether the
@@ -427,17 +718,608 @@ int NeedRefetch_HTTP_curl(std::string myPfn, time_t mTime)
                 */
             }
             else if (strcasestr(chunk.data, "HTTP/1.1 304 Not Modified") != NULL) 
+            {
                 rc = 0;
+                entry->loMod = 0;
+                entry->hiMod = mTime;
+                // the cached copy is current, so are its validators
+                entry->etag = httpHeader(chunk.data, "ETag");
+                entry->digest = httpHeader(chunk.data, "Digest");
+            }
+            else if (curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &httpCode) == CURLE_OK &&
+                     (httpCode == 404 || httpCode == 410))
+                rc = 4;
         }
     }
 
     curl_easy_cleanup(curl_handle);
+    curl_slist_free_all(headers);
 
     free(chunk.data);
     free(rmturl);
+
+    if (location != "" && (rc == 2 || rc == 4))
+    {
+        XcacheHLog(XCACHEH_LOG_DBG, "redirect target failed, check from the start: %s", myPfn);
+        redirectForget(myPfn);
+        return NeedRefetch_HTTP_curl(myPfn, mTime, cachedSize, entry);
+    }
+    // only a chain that ended in an answer is worth remembering
+    if (newLocation != "" && newLocationTTL > 0 && rc != 2 && rc != 4)
+        redirectRemember(myPfn, newLocation, newLocationTTL);
     return rc;
 }
 
+// Directory listings (WebDAV Depth:1 PROPFIND) that were done recently.
+// 0 means the PROPFIND is in progress. A listing is trusted for propfindTTL
+// only: it is older than a HEAD done at the time of the open would be.
+#define MAXPROPFINDDIRS 10000
+std::map<std::string, time_t> propfindDirs;
+unsigned long propfindInserts = 0;
+std::mutex propfindMutex;
+std::condition_variable propfindCond;
+
+static const char *propfindBody =
+    "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+    "<D:propfind xmlns:D=\"DAV:\"><D:prop>"
+    "<D:resourcetype/><D:getlastmodified/><D:getetag/><D:getcontentlength/>"
+    "</D:prop></D:propfind>";
+
+static std::string xmlText(const std::string in)
+{
+    std::string out = in;
+    size_t i;
+
+    while ((i = out.find("&quot;")) != std::string::npos) out.replace(i, 6, "\"");
+    while ((i = out.find("&amp;")) != std::string::npos) out.replace(i, 5, "&");
+    return out;
+}
+
+static std::string hrefDecode(const std::string in)
+{
+    std::string out;
+
+    for (size_t i = 0; i < in.length(); i++)
+    {
+        if (in[i] == '%' && i + 2 < in.length() && isxdigit(in[i+1]) && isxdigit(in[i+2]))
+        {
+            out += (char)strtol(in.substr(i+1, 2).c_str(), NULL, 16);
+            i += 2;
+        }
+        else
+            out += in[i];
+    }
+    return out;
+}
+
+// Walk a multistatus response and put every non-collection member that is
+// in the cache into the freshness table. urlPrefix (e.g. https://host:port)
+// turns a href into a url. Return the number of members found.
+static int parsePropfind(const char *xml, const std::string urlPrefix, time_t checkT)
+{
+    const char *c = xml, *e;
+    std::string tag, href, lastMod, etag, length;
+    int isEnd, isCollection = 0, nMembers = 0;
+
+    while ((c = strchr(c, '<')) != NULL)
+    {
+        e = strchr(++c, '>');
+        if (e == NULL) break;
+        tag.assign(c, e - c);
+        c = e + 1;
+
+        isEnd = (tag[0] == '/');
+        if (isEnd) tag.erase(0, 1);
+        // local name only: no attributes, no namespace prefix, no trailing "/"
+        tag = tag.substr(0, tag.find_first_of(" \t\r\n/"));
+        if (tag.find(":") != std::string::npos) tag.erase(0, tag.find(":") +1);
+
+        if (tag == "response")
+        {
+            if (! isEnd)
+            {
+                href = lastMod = etag = length = "";
+                isCollection = 0;
+            }
+            else if (! isCollection && href != "" && lastMod != "")
+            {
+                struct freshEntry entry;
+                time_t lastModT = curl_getdate(lastMod.c_str(), NULL);
+
+                if (lastModT == -1) continue;
+                entry.checkT = checkT;
+                entry.ttl = propfindTTL;
+                entry.gen = 0;
+                entry.loMod = lastModT -1;
+                entry.hiMod = lastModT;
+                entry.size = (length != ""? atoll(length.c_str()) : -1);
+                entry.digest = "";
+
+                href = hrefDecode(href);
+                if (href.find("http") != 0) href = urlPrefix + href;
+                nMembers++;
+
+                struct stat myStat;
+                if (cacheFileStat(href, &myStat) != 0) continue;
+                // the ETag is of the cached copy only if that is current
+                entry.etag = (myStat.st_mtime >= lastModT? xmlText(etag) : "");
+                freshTableUpdate(href, &entry);
+            }
+        }
+        else if (isEnd)
+            continue;
+        else if (tag == "collection")
+            isCollection = 1;
+        else if (tag == "href" || tag == "getlastmodified" || tag == "getetag" || tag == "getcontentlength")
+        {
+            e = strchr(c, '<');
+            if (e == NULL) break;
+            if (tag == "href") href.assign(c, e - c);
+            else if (tag == "getlastmodified") lastMod.assign(c, e - c);
+            else if (tag == "getetag") etag.assign(c, e - c);
+            else length.assign(c, e - c);
+        }
+    }
+    return nMembers;
+}
+
+// One Depth:1 PROPFIND of the collection holding myPfn, replacing a HEAD
+// for every sibling that is opened after it. Concurrent callers for the
+// same collection wait for the one in progress.
+//
+// Return
+// 0: the collection was listed, results are in the freshness table.
+// 2: listing was not done (recently done, or not successful).
+//
+int CheckDir_HTTP_propfind(std::string myPfn)
+{
+    std::string url, cgi, dir, urlPrefix;
+    size_t i;
+
+    url = myPfn.substr(0, myPfn.find("?"));
+    cgi = myPfn.substr(url.length());
+    i = url.find("/", url.find("://") +3);
+    if (url.find("://") == std::string::npos || i == std::string::npos) return 2;
+    urlPrefix = url.substr(0, i);
+    dir = url.substr(0, url.rfind("/") +1);
+
+    time_t currTime = time(NULL);
+    { // lock will be released when going out of the scope
+        std::unique_lock<std::mutex> lock(propfindMutex);
+        std::map<std::string, time_t>::iterator it = propfindDirs.find(dir);
+        if (it != propfindDirs.end())
+        {
+            if (it->second != 0 && (currTime - it->second) <= propfindTTL) return 2;
+            if (it->second == 0)
+            {
+                propfindCond.wait_for(lock, std::chrono::seconds(180),
+                                      [dir]{ return propfindDirs[dir] != 0; });
+                return 0;
+            }
+        }
+        // a listing in progress never expires here
+        boundedMapPrune(propfindDirs, MAXPROPFINDDIRS, &propfindInserts,
+                        [](time_t doneT) { return (doneT == 0? (time_t)LLONG_MAX : doneT + propfindTTL); });
+        propfindDirs[dir] = 0;
+    }
+
+    struct httpResp chunk;
+    struct curl_slist *headers = NULL;
+    CURL *curl_handle;
+    CURLcode res;
+    long httpCode = 0;
+    int nMembers = 0;
+    std::string rmturl = dir + cgi;
+
+    chunk.data = (char*)malloc(1);
+    chunk.size = 0;
+
+    headers = curl_slist_append(headers, "Depth: 1");
+    headers = curl_slist_append(headers, "Content-Type: application/xml; charset=utf-8");
+
+    curl_handle = curl_easy_init();
+    curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(curl_handle, CURLOPT_URL, rmturl.c_str());
+    curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(curl_handle, CURLOPT_CUSTOMREQUEST, "PROPFIND");
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, propfindBody);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, XcacheHRemoteStatCallback);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
+    curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_MAXREDIRS, 5L);
+    curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, 180L);
+    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+
+    res = curl_easy_perform(curl_handle);
+    XcacheHTraceCurl(curl_handle, "curl PROPFIND");
+    if (res == CURLE_OK) 
+        curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &httpCode);
+    if (res == CURLE_OK && (httpCode == 401 || httpCode == 403))
+    { // try with X509
+        free(chunk.data);
+        chunk.data = (char*)malloc(1);
+        chunk.size = 0; 
+        curlUseX509(curl_handle);
+        res = curl_easy_perform(curl_handle);
+        XcacheHTraceCurl(curl_handle, "curl PROPFIND x509");
+        if (res == CURLE_OK) 
+            curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &httpCode);
+    }
+
+    if (res == CURLE_OK && httpCode == 207) // Multi-Status
+        nMembers = parsePropfind(chunk.data, urlPrefix, currTime);
+
+    curl_easy_cleanup(curl_handle);
+    curl_slist_free_all(headers);
+    free(chunk.data);
+
+    {
+        std::lock_guard<std::mutex> guard(propfindMutex);
+        propfindDirs[dir] = time(NULL);
+    }
+    propfindCond.notify_all();
+
+    XcacheHLogNum(XCACHEH_LOG_INFO, "PROPFIND %s HTTP %d, members: %d", dir, httpCode, nMembers);
+
+    return (nMembers > 0? 0 : 2);
+}
+
+// Outcomes of origin checks that say nothing about freshness: the file is
+// gone (4) or the origin couldn't be asked (2). They are remembered for
+// goneTTL and unreachableTTL, so that opens of such urls (e.g. from a broken
+// job config) neither ask the origin again nor wait for someone asking it.
+#define MAXNEGATIVEENTRIES 100000
+
+struct negativeEntry
+{
+    time_t until;
+    int rc;
+};
+
+std::map<std::string, struct negativeEntry> negativeCache;  // see negativeKey()
+unsigned long negativeInserts = 0;
+std::mutex negativeMutex;
+
+// The url without CGI, plus a hash of the CGI if there is one: the check
+// was made with the requester's CGI (e.g. an authz token), its outcome
+// says nothing about the same url asked with other credentials.
+static std::string negativeKey(const std::string myPfn)
+{
+    size_t i = myPfn.find("?");
+
+    if (i == std::string::npos || i == myPfn.length() -1) return myPfn.substr(0, i);
+    return myPfn.substr(0, i) + "#" + std::to_string(std::hash<std::string>()(myPfn.substr(i +1)));
+}
+
+static void negativeRemember(std::string myPfn, int rc)
+{
+    time_t ttl = (rc == 4? goneTTL : unreachableTTL);
+    time_t currTime = time(NULL);
+
+    if (ttl <= 0) return;
+
+    std::lock_guard<std::mutex> guard(negativeMutex);
+    boundedMapPrune(negativeCache, MAXNEGATIVEENTRIES, &negativeInserts,
+                    [](const struct negativeEntry &e) { return e.until; });
+    negativeCache[negativeKey(myPfn)] = {currTime + ttl, rc};
+}
+
+// Return the remembered outcome (2 or 4), 0 if there is none
+static int negativeLookup(std::string myPfn)
+{
+    std::lock_guard<std::mutex> guard(negativeMutex);
+    std::map<std::string, struct negativeEntry>::iterator it = negativeCache.find(negativeKey(myPfn));
+
+    if (it == negativeCache.end()) return 0;
+    if (it->second.until >= time(NULL)) return it->second.rc;
+    negativeCache.erase(it);
+    return 0;
+}
+
+// Ask the origin at most once per url at a time, across all the processes
+// sharing the freshness table. The others wait for the verdict, or ask
+// themselves if it doesn't fit their cached copy.
+//
+// Return: same as NeedRefetch_HTTP()
+int NeedRefetch_HTTP_once(std::string myPfn, time_t mTime, off_t cachedSize)
+{
+    struct freshEntry entry;
+    time_t waitT = time(NULL);
+    int rc, claimed;
+
+    while (! (claimed = freshTableClaim(myPfn)) && (time(NULL) - waitT) < 180)
+    {
+        freshTableWait(myPfn);
+        rc = freshTableVerdict(myPfn, mTime);
+        if (rc >= 0) return rc;
+        rc = negativeLookup(myPfn);
+        if (rc > 0) return rc;
+    }
+
+    rc = NeedRefetch_HTTP(myPfn, mTime, cachedSize, &entry);
+    if (rc == 0 || rc == 1)
+        freshTableUpdate(myPfn, &entry);
+    else
+        negativeRemember(myPfn, rc);
+    if (claimed) freshTableRelease(myPfn);
+    return rc;
+}
+
+#define MAXMETALINKSIZE 1048576
+
+static size_t XcacheHMetalinkCallback(void *contents,
+                                      size_t size,
+                                      size_t nmemb,
+                                      void *userp)
+{
+    size_t realsize = size * nmemb;
+    struct httpResp *mem = (struct httpResp *)userp;
+
+    // the origin ignored the Accept: header and is sending the file itself
+    if (mem->size == 0 && realsize > 0 && strchr(" \t\r\n<", ((char*)contents)[0]) == NULL) return 0;
+    if (mem->size + realsize > MAXMETALINKSIZE) return 0;
+    return XcacheHRemoteStatCallback(contents, size, nmemb, userp);
+}
+
+// The http(s) replicas of myPfn, from the metalink (RFC 5854) the origin
+// returns to "Accept: application/metalink4+xml" (e.g. DynaFed, dCache).
+// Return their number, 0 if the origin doesn't provide a metalink.
+int XcacheHReplicas(const std::string myPfn, std::vector<std::string> *replicas)
+{
+    struct httpResp chunk;
+    struct curl_slist *headers = NULL;
+    CURL *curl_handle;
+    CURLcode res;
+    long httpCode = 0;
+    int nReplicas = 0;
+
+    if (myPfn.find("http") != 0) return 0;
+
+    chunk.data = (char*)malloc(1);
+    chunk.data[0] = 0;
+    chunk.size = 0;
+
+    headers = curl_slist_append(headers, "Accept: application/metalink4+xml");
+
+    curl_handle = curl_easy_init();
+    curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(curl_handle, CURLOPT_URL, myPfn.c_str());
+    curl_easy_setopt(curl_handle, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, XcacheHMetalinkCallback);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
+    curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_MAXREDIRS, 5L);
+    curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, 60L);
+    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+
+    res = curl_easy_perform(curl_handle);
+    if (res == CURLE_OK) 
+        curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &httpCode);
+    if (res == CURLE_OK && (httpCode == 401 || httpCode == 403))
+    { // try with X509
+        free(chunk.data);
+        chunk.data = (char*)malloc(1);
+        chunk.data[0] = 0;
+        chunk.size = 0; 
+        curlUseX509(curl_handle);
+        res = curl_easy_perform(curl_handle);
+        if (res == CURLE_OK) 
+            curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &httpCode);
+    }
+
+    if (res == CURLE_OK && httpCode == 200 && strstr(chunk.data, "<metalink") != NULL)
+    {
+        const char *c = chunk.data, *e;
+        while ((c = strstr(c, "<url")) != NULL && (e = strstr(c, "</url>")) != NULL)
+        {
+            c = strchr(c, '>');
+            if (c == NULL || c > e) break;
+            std::string replica = xmlText(std::string(c +1, e - c -1));
+            XcacheHLog(XCACHEH_LOG_DBG, "replica %s", replica);
+            if (replica.find("http://") == 0 || replica.find("https://") == 0)
+            {
+                replicas->push_back(replica);
+                nReplicas++;
+            }
+            c = e;
+        }
+    }
+
+    curl_easy_cleanup(curl_handle);
+    curl_slist_free_all(headers);
+    free(chunk.data);
+    return nReplicas;
+}
+
+// Generations of a cache entry: gen 0 is the lfn of url2lfn(), gen g the
+// same with REFRESHSUFFIX and g in hex. The gen in use is kept in the
+// freshness table (see freshTableSetGen()).
+#define REFRESHSUFFIX ".xcacheg"
+
+static std::string genLfn(const std::string myPfn, long long gen)
+{
+    char *lfn = url2lfn(myPfn);
+    std::string myLfn = lfn;
+    char suffix[17];
+
+    free(lfn);
+    if (gen == 0) return myLfn;
+    snprintf(suffix, sizeof(suffix), "%016llx", (unsigned long long)gen);
+    return myLfn + REFRESHSUFFIX + suffix;
+}
+
+std::string XcacheHLfn(const std::string myPfn)
+{
+    return genLfn(myPfn, (refreshSwap? freshTableGen(myPfn) : 0));
+}
+
+// Reads that must go to a given cache entry: the replica reads of a
+// parallel stage-in, and the stage-in of a new generation of a changed file
+// (see refreshMode=swap). The url is opened with REPLICATOKEN=<random id>,
+// pfn2lfn() maps the id to the lfn of that entry, so that Pfc puts the
+// blocks there and fetches each of them from the url that asked for it.
+// The id is random so that no other client can make an url fill that entry.
+#define REPLICATOKEN "xcachereplica"
+
+std::map<std::string, std::string> replicaOf;  // id -> lfn the reads go to
+std::mutex replicaMutex;
+
+// register lfn under a new id, return the id. With genOf, the lfn is the
+// generation of genOf's cache entry that has the id for its gen.
+static std::string replicaRegister(const std::string lfn, const std::string genOf = "")
+{
+    static std::mt19937_64 rng(std::random_device{}());
+    char id[17];
+
+    std::lock_guard<std::mutex> guard(replicaMutex);
+    do
+        snprintf(id, sizeof(id), "%016llx", (unsigned long long)rng());
+    while (replicaOf.find(id) != replicaOf.end() || strtoull(id, NULL, 16) == 0);
+    replicaOf[id] = (genOf != ""? genLfn(genOf, (long long)strtoull(id, NULL, 16)) : lfn);
+    return id;
+}
+
+// The lfn the reads of myPfn go to: the one registered if myPfn has a
+// REPLICATOKEN (a refresh being staged in), otherwise the one in use.
+static std::string replicaTarget(const std::string myPfn)
+{
+    size_t i = myPfn.rfind(REPLICATOKEN "=");
+
+    if (i != std::string::npos)
+    {
+        std::string myLfn = XcacheHReplicaLfn(myPfn.substr(i + strlen(REPLICATOKEN "=")));
+        if (myLfn != "") return myLfn;
+    }
+    return XcacheHLfn(myPfn);
+}
+
+std::string XcacheHReplicaUrl(const std::string replica, const std::string myPfn)
+{
+    std::string id = replicaRegister(replicaTarget(myPfn));
+
+    return replica + (replica.find("?") == std::string::npos? "?" : "&") + REPLICATOKEN + "=" + id;
+}
+
+void XcacheHReplicaDone(const std::string replicaUrl)
+{
+    size_t i = replicaUrl.rfind(REPLICATOKEN "=");
+
+    if (i == std::string::npos) return;
+    std::lock_guard<std::mutex> guard(replicaMutex);
+    replicaOf.erase(replicaUrl.substr(i + strlen(REPLICATOKEN "=")));
+}
+
+std::string XcacheHReplicaLfn(const std::string id)
+{
+    std::lock_guard<std::mutex> guard(replicaMutex);
+    std::map<std::string, std::string>::iterator it = replicaOf.find(id);
+
+    return (it != replicaOf.end()? it->second : "");
+}
+
+// Refresh by swap: instead of purging a changed file, stage the new
+// version in under a new generation of its cache entry, then switch the
+// url to it and purge the old one. Pfc can't rename an entry, but it
+// doesn't have to: the lfn is only the name of the entry, pfn2lfn() picks
+// it. The old copy is served meanwhile, for refreshStale at most. If the
+// freshness entry holding the gen is lost, the url falls back to gen 0,
+// purged at the swap, which costs a cold read as without refreshMode=swap.
+#define REFRESHSWAPWAIT 30  // seconds for Pfc to finish writing the new entry
+#define MAXREFRESHENTRIES 10000
+
+struct refreshEntry
+{
+    std::string id;  // the REPLICATOKEN of the stage-in, also the new gen
+    time_t startT;
+};
+
+std::map<std::string, struct refreshEntry> refreshing;  // url without CGI
+unsigned long refreshInserts = 0;
+std::mutex refreshMutex;
+
+// Return
+// 1: a refresh of myPfn is in progress, serve the old copy
+// 0: there is none, or it took longer than refreshStale: the old copy is
+//    then purged, and the new one dropped when its stage-in is done
+static int refreshPending(std::string myPfn)
+{
+    {
+        std::lock_guard<std::mutex> guard(refreshMutex);
+        std::map<std::string, struct refreshEntry>::iterator it = refreshing.find(myPfn.substr(0, myPfn.find("?")));
+
+        if (it == refreshing.end()) return 0;
+        if ((time(NULL) - it->second.startT) <= refreshStale) return 1;
+        refreshing.erase(it);
+    }
+    int rc = cacheFilePurge(myPfn);
+    XcacheHLogNum(XCACHEH_LOG_ERR, "refresh took longer than refreshStale, purge (rc %d)", XcacheHLfn(myPfn), rc, 0);
+    return 0;
+}
+
+// Return 1 if a refresh of myPfn was started, 0 if one is already going
+static int refreshStart(std::string myPfn, const std::string tenant)
+{
+    std::string key = myPfn.substr(0, myPfn.find("?"));
+    std::string id;
+    {
+        std::lock_guard<std::mutex> guard(refreshMutex);
+        if (refreshing.find(key) != refreshing.end()) return 0;
+
+        id = replicaRegister("", myPfn);
+        boundedMapPrune(refreshing, MAXREFRESHENTRIES, &refreshInserts,
+                        [](const struct refreshEntry &e) { return e.startT + refreshStale; });
+        refreshing[key] = {id, time(NULL)};
+    }
+    addToStageinList(myPfn + (myPfn.find("?") == std::string::npos? "?" : "&") + REPLICATOKEN + "=" + id, tenant);
+    return 1;
+}
+
+int XcacheHRefreshDone(const std::string stagingPfn)
+{
+    size_t i = stagingPfn.rfind(REPLICATOKEN "=");
+    std::string myPfn, id, newLfn, oldLfn;
+    int rc, n, current;
+
+    if (i == std::string::npos) return 0;
+    myPfn = stagingPfn.substr(0, i -1);  // refreshStart() put "?" or "&" + REPLICATOKEN last
+    id = stagingPfn.substr(i + strlen(REPLICATOKEN "="));
+    newLfn = XcacheHReplicaLfn(id);
+    {
+        std::lock_guard<std::mutex> guard(refreshMutex);
+        std::map<std::string, struct refreshEntry>::iterator it = refreshing.find(myPfn.substr(0, myPfn.find("?")));
+        current = (it != refreshing.end() && it->second.id == id);
+        if (current) refreshing.erase(it);
+    }
+
+    for (n = 0; current && n < REFRESHSWAPWAIT && cacheFileQueryLfn(newLfn) <= 0; n++)
+        sleep(1);
+
+    if (! current)
+    {
+        // given up (the old copy was purged) or superseded
+        cacheFilePurgeLfn(newLfn);
+        XcacheHLog(XCACHEH_LOG_INFO, "refresh no longer wanted, drop the new copy", newLfn);
+    }
+    else if (cacheFileQueryLfn(newLfn) > 0)
+    {
+        oldLfn = XcacheHLfn(myPfn);
+        freshTableSetGen(myPfn, (long long)strtoull(id.c_str(), NULL, 16));
+        rc = cacheFilePurgeLfn(oldLfn);
+        XcacheHLogNum(XCACHEH_LOG_INFO, "refreshed, new version in use, old one purged (rc %d): %s",
+                      newLfn, rc, 0);
+    }
+    else
+    {
+        cacheFilePurgeLfn(newLfn);
+        rc = cacheFilePurge(myPfn);
+        XcacheHLogNum(XCACHEH_LOG_ERR, "refresh incomplete, purge (rc %d): %s", XcacheHLfn(myPfn), rc, 0);
+    }
+    XcacheHReplicaDone(stagingPfn);
+    return 1;
+}
+
 // to be implemented
 int NeedRefetch_ROOT(std::string myPfn, time_t mTime)  {}
 
@@ -478,19 +1360,58 @@ int NeedRefetch_HTTP_Davix(std::string myPfn, time_t mTime)
 */
 
 std::string XcacheHCheckFile(const std::string myPfn,
-                             int stageinRequest)
+                             int stageinRequest,
+                             const std::string tenant)
 {
-    std::string rmtUrl, myLfn, msg;
+    std::string rmtUrl, myLfn;
+    const char *msg = "";
     struct stat myStat;
     int rc;
 
-    myLfn = url2lfn(myPfn);
+    {
+        XcacheHSpan span("url2lfn");
+        myLfn = XcacheHLfn(myPfn);
+    }
+    if (inCheck) return myLfn;  // opened by sampleCompare(), being checked
 
-    rc = cacheFileQuery(myPfn);
+    // a newer version is being staged in
+    if (refreshSwap && stageinRequest == 0 && refreshPending(myPfn) == 1)
+    {
+        XcacheHLog(XCACHEH_LOG_INFO, "refresh in progress, serve the old copy", myLfn);
+        return myLfn;
+    }
+
+    // the origin file changed and the cached copy is about to go. A stage-in
+    // of it now would only read the old data, it is queued after the purge.
+    if (purgeRoute(myPfn) == 1)
+    {
+        if (stageinRequest != 1)
+        {
+            XcacheHLog(XCACHEH_LOG_INFO, "purge pending, serve the cached copy", myLfn);
+            return myLfn;
+        }
+        if (purgeHoldStagein(myPfn, tenant) == 1)
+        {
+            XcacheHLog(XCACHEH_LOG_INFO, "purge pending, stagein queued after it", myLfn);
+            return "EALREADY";
+        }
+        // the purge just finished, go on as usual
+    }
+
+    if (myPfn.find("http") == 0 && negativeLookup(myPfn) == 4)
+    {
+        XcacheHLog(XCACHEH_LOG_INFO, "gone at the origin (remembered)", myLfn);
+        return "ENOENT";
+    }
+
+    {
+        XcacheHSpan span("cacheFileQuery");
+        rc = cacheFileQuery(myPfn);
+    }
 
     if (rc <= 0 && stageinRequest == 1)
     {
-        addToStageinList(myPfn);
+        addToStageinList(myPfn, tenant);
         return "EALREADY"; 
     }
     else 
@@ -499,7 +1420,11 @@ std::string XcacheHCheckFile(const std::string myPfn,
     }
 
     myStat.st_mtime = myStat.st_atime = 0;
-    rc = cacheFileStat(myPfn, &myStat);
+    myStat.st_size = -1;
+    {
+        XcacheHSpan span("cacheFileStat");
+        rc = cacheFileStat(myPfn, &myStat);
+    }
 
     time_t currTime = time(NULL);
 
@@ -508,11 +1433,46 @@ std::string XcacheHCheckFile(const std::string myPfn,
     {
         if (myPfn.find("http") == 0) // http or https protocol
         {
-            rc = NeedRefetch_HTTP(myPfn, myStat.st_mtime);
+            // a PROPFIND of the parent collection answers for all the siblings
+            time_t mTime = myStat.st_mtime;
+
+            rc = freshTableVerdict(myPfn, mTime);
+            if (rc < 0 && negativeLookup(myPfn) == 2)
+                rc = 2;  // the origin couldn't be asked a moment ago, don't wait for it again
+            if (rc < 0 && davPropfind == 1)
+            {
+                XcacheHSpan span("propfind");
+                if (CheckDir_HTTP_propfind(myPfn) == 0) rc = freshTableVerdict(myPfn, mTime);
+            }
+            if (rc < 0)
+            {
+                XcacheHSpan span("origin check");
+                rc = NeedRefetch_HTTP_once(myPfn, mTime, myStat.st_size);
+            }
             if (rc == 0) 
                 msg = "no need to refetch!";
+            else if (rc == 1 && refreshSwap && cacheFileQuery(myPfn) > 0)
+            {
+                if (refreshStart(myPfn, tenant) == 1)
+                    msg = "refresh, serve the old copy until the new one is staged in";
+                else
+                    msg = "refresh already in progress";
+            }
+            else if (rc == 1 && purgeAsync())
+            {
+                if (purgeSubmit(myPfn) == 1)
+                    msg = "purge queued";
+                else
+                    msg = "purge already pending";
+                if (stageinRequest == 1 && purgeHoldStagein(myPfn, tenant) == 1)
+                {
+                    XcacheHLog(XCACHEH_LOG_INFO, "purge pending, stagein queued after it", myLfn);
+                    return "EALREADY";
+                }
+            }
             else if (rc == 1)
             {
+                XcacheHSpan span("cacheFilePurge");
                 rc = cacheFilePurge(myPfn);
                 if (rc == 0)
                     msg = "purge"; 
@@ -523,6 +1483,11 @@ std::string XcacheHCheckFile(const std::string myPfn,
                 else if (rc == -errno)
                     msg = "fail to purge";
             }
+            else if (rc == 4)
+            {
+                XcacheHLog(XCACHEH_LOG_INFO, "gone at the origin", myLfn);
+                return "ENOENT";
+            }
             else // rc = 2
                 msg = "data source no available!";
         }
@@ -535,8 +1500,7 @@ std::string XcacheHCheckFile(const std::string myPfn,
     else 
         msg = "not purge - likely in use!";
 
-    msg = myName + ": " + msg + " " + myLfn;
-    if (XcacheH_DBG != 0) eDest->Say(msg.c_str()); 
+    XcacheHLog(XCACHEH_LOG_INFO, msg, myLfn);
 
     return myLfn;  
 }
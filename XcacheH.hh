@@ -3,6 +3,8 @@
  * SLAC National Accelerator Laboratory / Stanford University, 2020
  */
 
+#include <string>
+#include <vector>
 #include "XrdSys/XrdSysError.hh"
 
 struct cacheOptions
@@ -11,7 +13,37 @@ struct cacheOptions
     size_t blockSize; 
     int    xrdPort;
     std::string hostName;
+    int    propfind;
+    time_t propfindTTL;
+    int    stageinLoopback;
+    std::string stageinOrder;
+    std::string stageinDiskPath;
+    double stageinDiskHigh;
+    time_t redirectTTL;
+    std::string freshTableShm;
+    int    stageinStreams;
+    std::string freshSnapshot;
+    time_t freshSnapshotInterval;
+    std::string purgeMode;
+    int    purgeRate;
+    std::string purgePending;
+    time_t purgeWait;
+    std::string stageinWeights;
+    double traceSample;
+    std::string traceFile;
+    std::string refreshMode;
+    time_t refreshStale;
+    time_t goneTTL;
+    time_t unreachableTTL;
 };
 
 void XcacheHInit(XrdSysError* eDest, const std::string myName, struct cacheOptions *cacheOpt);
-std::string XcacheHCheckFile(const std::string myPfn, int stageinRequest);
+std::string XcacheHCheckFile(const std::string myPfn, int stageinRequest, const std::string tenant = "");
+int XcacheHReplicas(const std::string myPfn, std::vector<std::string> *replicas);
+// a replica url for one reader of a parallel stage-in of myPfn, and its lfn
+std::string XcacheHReplicaUrl(const std::string replica, const std::string myPfn);
+void XcacheHReplicaDone(const std::string replicaUrl);
+std::string XcacheHReplicaLfn(const std::string id);
+// the lfn of the cache entry of myPfn in use (see refreshMode=swap)
+std::string XcacheHLfn(const std::string myPfn);
+int XcacheHRefreshDone(const std::string stagingPfn);
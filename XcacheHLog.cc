@@ -0,0 +1,174 @@
+using namespace std;
+
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+
+#include "XcacheHLog.hh"
+
+#define LOGRINGSIZE 256  // records per thread, power of 2
+#define LOGARGLEN   240  // longer string arguments are truncated
+#define LOGFLUSHINTERVAL 100000  // usec
+
+struct logRecord
+{
+    int level;
+    const char *fmt;
+    long long n[2];
+    char arg[LOGARGLEN];
+};
+
+// single producer (the owning thread), single consumer (logFlusher)
+struct logRing
+{
+    std::atomic<unsigned int> head;
+    std::atomic<unsigned int> tail;
+    std::atomic<unsigned long> dropped;
+    std::atomic<bool> orphan;  // the owning thread is gone
+    struct logRecord recs[LOGRINGSIZE];
+};
+
+// marks the ring of a thread as orphan when the thread exits
+struct logRingOwner
+{
+    struct logRing *ring;
+    ~logRingOwner() { if (ring != NULL) ring->orphan = true; }
+};
+
+int XcacheHLogLevel = XCACHEH_LOG_INFO;
+
+static XrdSysError *logDest = NULL;
+static std::string logName;
+
+static thread_local struct logRingOwner myRing = {NULL};
+static std::list<struct logRing*> logRings;
+static std::mutex logRingsMutex;
+
+static struct logRing *newLogRing()
+{
+    struct logRing *ring = new struct logRing;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+    ring->orphan = false;
+
+    std::lock_guard<std::mutex> guard(logRingsMutex);
+    logRings.push_back(ring);
+    return ring;
+}
+
+void XcacheHLogPut(int level, const char *fmt, const char *arg, long long n0, long long n1)
+{
+    if (myRing.ring == NULL) myRing.ring = newLogRing();
+    struct logRing *ring = myRing.ring;
+
+    unsigned int head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= LOGRINGSIZE)
+    {
+        ring->dropped++;
+        return;
+    }
+
+    struct logRecord *rec = &ring->recs[head & (LOGRINGSIZE -1)];
+    rec->level = level;
+    rec->fmt = fmt;
+    rec->n[0] = n0;
+    rec->n[1] = n1;
+    strncpy(rec->arg, (arg != NULL? arg : ""), LOGARGLEN -1);
+    rec->arg[LOGARGLEN -1] = 0;
+
+    ring->head.store(head +1, std::memory_order_release);
+}
+
+static std::string logFormat(struct logRecord *rec)
+{
+    std::string msg = logName + ": ";
+    const char *c;
+    int hasArg = 0, n = 0;
+
+    if (rec->level == XCACHEH_LOG_ERR) msg += "error: ";
+    for (c = rec->fmt; *c != 0; c++)
+    {
+        if (c[0] == '%' && c[1] == 's')
+        {
+            msg += rec->arg;
+            hasArg = 1;
+            c++;
+        }
+        else if (c[0] == '%' && c[1] == 'd' && n < 2)
+        {
+            msg += std::to_string(rec->n[n++]);
+            c++;
+        }
+        else
+            msg += *c;
+    }
+    if (! hasArg && rec->arg[0] != 0)
+        msg = msg + " " + rec->arg;
+    return msg;
+}
+
+// Records are copied out of the rings under logRingsMutex and written
+// after it is released, so that a thread logging for the first time
+// (newLogRing()) never waits for the log file.
+static void logFlusher()
+{
+    std::list<struct logRing*>::iterator it;
+    std::vector<struct logRecord> recs;
+    std::vector<std::string> notes;
+    unsigned int head, tail;
+    unsigned long dropped;
+    size_t i;
+
+    while (! usleep(LOGFLUSHINTERVAL))
+    {
+        {
+            std::lock_guard<std::mutex> guard(logRingsMutex);
+            it = logRings.begin();
+            while (it != logRings.end())
+            {
+                struct logRing *ring = *it;
+                bool orphan = ring->orphan;  // read before draining the last records
+
+                head = ring->head.load(std::memory_order_acquire);
+                for (tail = ring->tail.load(std::memory_order_relaxed); tail != head; tail++)
+                    recs.push_back(ring->recs[tail & (LOGRINGSIZE -1)]);
+                ring->tail.store(tail, std::memory_order_release);
+
+                dropped = ring->dropped.exchange(0);
+                if (dropped > 0)
+                    notes.push_back(logName + ": log ring full, dropped " + std::to_string(dropped) + " messages");
+
+                if (orphan)
+                {
+                    delete ring;
+                    logRings.erase(it++);
+                }
+                else
+                    ++it;
+            }
+        }
+
+        for (i = 0; i < recs.size(); i++)
+            logDest->Say(logFormat(&recs[i]).c_str());
+        for (i = 0; i < notes.size(); i++)
+            logDest->Say(notes[i].c_str());
+        recs.clear();
+        notes.clear();
+    }
+}
+
+void XcacheHLogInit(XrdSysError *eDest, const std::string myName, int level)
+{
+    logDest = eDest;
+    logName = myName;
+    XcacheHLogLevel = level;
+
+    std::thread logThread(logFlusher);
+    logThread.detach();
+}
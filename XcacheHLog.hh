@@ -0,0 +1,35 @@
+// Leveled logging for the request path.
+//
+// A caller only copies a compact record (a format that must be a string
+// literal, one string argument and up to two numbers) into a ring buffer
+// owned by its thread. A background thread formats the records and writes
+// them with XrdSysError::Say(). When the ring is full the record is dropped
+// and counted. A disabled level costs one integer compare, the arguments
+// are not evaluated.
+//
+// Format: each "%s" is replaced by the string argument (appended after a
+// space if there is no "%s"), each "%d" by the next number.
+
+#include <string>
+#include "XrdSys/XrdSysError.hh"
+
+#define XCACHEH_LOG_ERR  0
+#define XCACHEH_LOG_INFO 1
+#define XCACHEH_LOG_DBG  2
+
+extern int XcacheHLogLevel;
+
+#define XcacheHLog(level, fmt, arg) \
+    do { if ((level) <= XcacheHLogLevel) XcacheHLogPut((level), (fmt), (arg), 0, 0); } while (0)
+
+#define XcacheHLogNum(level, fmt, arg, n0, n1) \
+    do { if ((level) <= XcacheHLogLevel) XcacheHLogPut((level), (fmt), (arg), (n0), (n1)); } while (0)
+
+void XcacheHLogInit(XrdSysError *eDest, const std::string myName, int level);
+
+void XcacheHLogPut(int level, const char *fmt, const char *arg, long long n0, long long n1);
+
+inline void XcacheHLogPut(int level, const char *fmt, const std::string &arg, long long n0, long long n1)
+{
+    XcacheHLogPut(level, fmt, arg.c_str(), n0, n1);
+}
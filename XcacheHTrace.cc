@@ -0,0 +1,226 @@
+using namespace std;
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#include "XcacheHTrace.hh"
+
+#define TRACEMAXSPANS 100000
+#define TRACEPOLLINTERVAL 1  // seconds between checks of the trigger file
+
+struct traceSpan
+{
+    const char *name;
+    long long ts;   // usec
+    long long dur;
+    long req;
+    std::string arg;
+};
+
+static long traceEvery = 0;  // 0: tracing is off
+static std::string traceFile;
+static std::atomic<long> traceOpens(0);
+
+static std::vector<struct traceSpan> traceSpans;
+static size_t traceNext = 0;  // where the next span goes, the buffer wraps
+static std::mutex traceMutex;
+
+static thread_local long traceReq = 0;  // the traced open of this thread, 0: none
+
+static long long traceNow()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void traceAdd(const char *name, long long ts, long long dur, const std::string &arg)
+{
+    std::lock_guard<std::mutex> guard(traceMutex);
+    struct traceSpan &span = traceSpans[traceNext];
+    span.name = name;
+    span.ts = ts;
+    span.dur = dur;
+    span.req = traceReq;
+    span.arg = arg;
+    traceNext = (traceNext +1) % TRACEMAXSPANS;
+}
+
+// A url as it may go into the trace: no CGI (authz tokens) and no
+// user:password@. The pss form /path?src=proto://host&cgi keeps its ?src=.
+static std::string traceUrl(const std::string &in)
+{
+    std::string out = in;
+    size_t i = out.find("?src=");
+
+    out = out.substr(0, (i != std::string::npos? out.find("&", i) : out.find("?")));
+    i = out.find("://");
+    if (i != std::string::npos)
+    {
+        size_t at = out.find("@", i);
+        if (at != std::string::npos && at < out.find("/", i +3)) out.erase(i +3, at - i -2);
+    }
+    return out;
+}
+
+static std::string jsonEscape(const std::string &in)
+{
+    std::string out;
+    char buff[8];
+
+    for (size_t i = 0; i < in.length(); i++)
+    {
+        if (in[i] == '"' || in[i] == '\\')
+        {
+            out += '\\';
+            out += in[i];
+        }
+        else if ((unsigned char)in[i] < 0x20)
+        {
+            snprintf(buff, sizeof(buff), "\\u%04x", in[i]);
+            out += buff;
+        }
+        else
+            out += in[i];
+    }
+    return out;
+}
+
+// Written to a new file (mkstemp: O_CREAT|O_EXCL, mode 0600, never through
+// a symlink) in the directory of traceFile, then renamed over it.
+static int traceDump()
+{
+    std::string tmpFile = traceFile + ".XXXXXX";
+    std::vector<char> tmpName(tmpFile.begin(), tmpFile.end());
+    int pid = getpid(), first = 1, fd;
+    FILE *fp;
+
+    tmpName.push_back(0);
+    fd = mkstemp(tmpName.data());
+    if (fd < 0) return -1;
+    tmpFile = tmpName.data();
+    fp = fdopen(fd, "w");
+    if (fp == NULL)
+    {
+        close(fd);
+        unlink(tmpFile.c_str());
+        return -1;
+    }
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    {
+        std::lock_guard<std::mutex> guard(traceMutex);
+        for (size_t n = 0; n < TRACEMAXSPANS; n++)
+        {
+            struct traceSpan &span = traceSpans[(traceNext + n) % TRACEMAXSPANS];
+            if (span.name == NULL) continue;
+            std::string args = (span.arg == ""? "{}" : "{\"url\":\"" + jsonEscape(span.arg) + "\"}");
+            fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"xcacheh\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                        "\"pid\":%d,\"tid\":%ld,\"args\":%s}",
+                    (first? "" : ",\n"), span.name, span.ts, span.dur, pid, span.req, args.c_str());
+            first = 0;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    if (fclose(fp) != 0 || rename(tmpFile.c_str(), traceFile.c_str()) != 0)
+    {
+        unlink(tmpFile.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+static void traceTrigger()
+{
+    std::string trigger = traceFile + ".trigger";
+    struct stat st;
+
+    while (1)
+    {
+        sleep(TRACEPOLLINTERVAL);
+        if (stat(trigger.c_str(), &st) != 0) continue;
+        unlink(trigger.c_str());
+        traceDump();
+    }
+}
+
+void XcacheHTraceInit(double sample, const std::string file)
+{
+    if (sample <= 0 || file == "") return;
+
+    traceFile = file;
+    traceSpans.resize(TRACEMAXSPANS);
+    for (size_t n = 0; n < TRACEMAXSPANS; n++) traceSpans[n].name = NULL;
+    traceEvery = (sample >= 1? 1 : (long)(1 / sample + 0.5));
+
+    std::thread trigger(traceTrigger);
+    trigger.detach();
+}
+
+XcacheHTraceRequest::XcacheHTraceRequest(const std::string myUrl)
+{
+    long n;
+
+    prevReq = traceReq;  // a pfn2lfn() nested in this thread's open
+    traceReq = 0;
+    if (traceEvery == 0) return;
+    n = ++traceOpens;
+    if (n % traceEvery != 0) return;
+
+    traceReq = n;
+    url = traceUrl(myUrl);
+    t0 = traceNow();
+}
+
+XcacheHTraceRequest::~XcacheHTraceRequest()
+{
+    if (traceReq != 0) traceAdd("open", t0, traceNow() - t0, url);
+    traceReq = prevReq;
+}
+
+XcacheHSpan::XcacheHSpan(const char *spanName)
+{
+    name = spanName;
+    if (traceReq != 0) t0 = traceNow();
+}
+
+XcacheHSpan::~XcacheHSpan()
+{
+    if (traceReq != 0) traceAdd(name, t0, traceNow() - t0, "");
+}
+
+void XcacheHTraceCurl(CURL *curl_handle, const char *name)
+{
+    double dns = 0, conn = 0, tls = 0, start = 0, total = 0;
+    char *url = NULL;
+
+    if (traceReq == 0) return;
+
+    // all are seconds from the start of the transfer
+    curl_easy_getinfo(curl_handle, CURLINFO_NAMELOOKUP_TIME, &dns);
+    curl_easy_getinfo(curl_handle, CURLINFO_CONNECT_TIME, &conn);
+    curl_easy_getinfo(curl_handle, CURLINFO_APPCONNECT_TIME, &tls);
+    curl_easy_getinfo(curl_handle, CURLINFO_STARTTRANSFER_TIME, &start);
+    curl_easy_getinfo(curl_handle, CURLINFO_TOTAL_TIME, &total);
+    curl_easy_getinfo(curl_handle, CURLINFO_EFFECTIVE_URL, &url);
+
+    long long t0 = traceNow() - (long long)(total * 1e6);
+    if (conn < dns) conn = dns;  // a reused connection reports 0
+    if (tls < conn) tls = conn;  // not https
+    if (start < tls) start = tls;
+
+    traceAdd(name, t0, (long long)(total * 1e6), (url != NULL? traceUrl(url) : ""));
+    traceAdd("curl dns", t0, (long long)(dns * 1e6), "");
+    traceAdd("curl connect", t0 + (long long)(dns * 1e6), (long long)((conn - dns) * 1e6), "");
+    traceAdd("curl tls", t0 + (long long)(conn * 1e6), (long long)((tls - conn) * 1e6), "");
+    traceAdd("curl wait", t0 + (long long)(tls * 1e6), (long long)((start - tls) * 1e6), "");
+    traceAdd("curl transfer", t0 + (long long)(start * 1e6), (long long)((total - start) * 1e6), "");
+}
@@ -0,0 +1,46 @@
+// Sampled per-request tracing of the open path.
+//
+// One open in every 1/traceSample is traced: each phase (url2lfn, cache
+// query/stat, origin check, each curl request and curl's own DNS, connect,
+// TLS, wait and transfer times, purge...) is kept as a span in a bounded
+// in-memory buffer; the oldest spans are overwritten. Creating
+// "<traceFile>.trigger" makes a background thread write the buffer to
+// traceFile as Chrome trace JSON (chrome://tracing, ui.perfetto.dev), one
+// row per traced open. An open that isn't traced costs one thread_local
+// read per span.
+//
+// There is no default traceFile: without one nothing is traced. It should
+// be in a directory only the server account can write to. The dump is
+// only readable by that account, and urls are traced without their CGI
+// (authz tokens) and user:password@.
+
+#include <string>
+#include <curl/curl.h>
+
+void XcacheHTraceInit(double sample, const std::string traceFile);
+
+// Lives for the whole open; decides whether the open is traced.
+class XcacheHTraceRequest
+{
+public:
+    XcacheHTraceRequest(const std::string url);
+    ~XcacheHTraceRequest();
+private:
+    std::string url;
+    long long t0;
+    long prevReq;
+};
+
+// A phase of a traced open, from construction to destruction
+class XcacheHSpan
+{
+public:
+    XcacheHSpan(const char *name);  // name must be a string literal
+    ~XcacheHSpan();
+private:
+    const char *name;
+    long long t0;
+};
+
+// spans of curl's timings of the last transfer on curl_handle, which just ended
+void XcacheHTraceCurl(CURL *curl_handle, const char *name);
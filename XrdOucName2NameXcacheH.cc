@@ -14,11 +14,38 @@ using namespace std;
 XrdVERSIONINFO(XrdOucgetName2Name, "N2N-XcacheH");
 
 #include "XcacheH.hh"
+#include "XcacheHTrace.hh"
 #include "XrdOuc/XrdOucEnv.hh"
 #include "XrdOuc/XrdOucName2Name.hh"
 #include "XrdSys/XrdSysPlatform.hh"
 #include "XrdSys/XrdSysError.hh"
 
+// convert a time option to seconds, unit: s/S (default), m/M, h/H, d/D
+// Return 0 if valid
+static int str2sec(std::string value, time_t *t)
+{
+    int unit = 1;
+    size_t i = value.find_first_not_of("0123456789");
+
+    if (value == "" || i == 0) return -1;
+    if (i != std::string::npos)
+    {
+        if (i != value.length() -1) return -1;
+        if (value[i] == 's' || value[i] == 'S')
+            unit = 1;
+        else if (value[i] == 'm' || value[i] == 'M')
+            unit = 60;
+        else if (value[i] == 'h' || value[i] == 'H')
+            unit = 3600;
+        else if (value[i] == 'd' || value[i] == 'D')
+            unit = 86400;
+        else
+            return -1;
+    }
+    *t = atol(value.c_str()) * unit;
+    return 0;
+}
+
 class XrdOucName2NameXcacheH : public XrdOucName2Name
 {
 public:
@@ -67,12 +94,35 @@ XrdOucName2NameXcacheH::XrdOucName2NameXcacheH(XrdSysError* erp, const char* con
     // the default
     cacheOpts.lifeT = 3600;
     cacheOpts.blockSize = 1048576;
+    cacheOpts.propfind = 0;
+    cacheOpts.stageinLoopback = 0;
+    cacheOpts.freshTableShm = "";
+    cacheOpts.stageinOrder = "fifo";
+    cacheOpts.stageinDiskPath = "";
+    cacheOpts.stageinDiskHigh = 0.85;
+    cacheOpts.redirectTTL = 300;
+    cacheOpts.stageinStreams = 1;
+    cacheOpts.freshSnapshot = "";
+    cacheOpts.freshSnapshotInterval = 300;
+    cacheOpts.purgeMode = "sync";
+    cacheOpts.purgeRate = 50;
+    cacheOpts.purgePending = "stale";
+    cacheOpts.purgeWait = 10;
+    cacheOpts.stageinWeights = "";
+    cacheOpts.traceSample = 0;
+    cacheOpts.traceFile = "";
+    cacheOpts.refreshMode = "purge";
+    cacheOpts.refreshStale = 600;
+    cacheOpts.goneTTL = 60;
+    cacheOpts.propfindTTL = 60;
+    cacheOpts.unreachableTTL = 30;
     cacheOpts.xrdPort = std::stoi(getenv("XRDPORT"));
 
     hostName = (char*)malloc(256);
     gethostname(hostName, 256);
+    // only used by the loopback stagein
     struct hostent *myHostEnt = gethostbyname(hostName);
-    cacheOpts.hostName = myHostEnt->h_name;
+    cacheOpts.hostName = (myHostEnt != NULL? myHostEnt->h_name : hostName);
     free(hostName);
 
     opts = parms;
@@ -180,6 +230,268 @@ XrdOucName2NameXcacheH::XrdOucName2NameXcacheH(XrdSysError* erp, const char* con
             {
                 cacheOpts.hostName = value;
             }
+            else if (key == "stageinLoopback") // 1: stagein via root://hostName:xrdPort instead of in-process
+            {
+                if (value == "0" || value == "1")
+                {
+                    cacheOpts.stageinLoopback = atoi(value.c_str());
+                }
+                else
+                {
+                    message = myName + " Init: option stageinLoopback = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "freshTableShm") // file to mmap, e.g. /dev/shm/xcacheh, to share freshness across processes
+            {
+                cacheOpts.freshTableShm = value;
+            }
+            else if (key == "propfindTTL") // how long a PROPFIND listing is trusted for the siblings
+            {
+                if (str2sec(value, &cacheOpts.propfindTTL) != 0 || cacheOpts.propfindTTL <= 0)
+                {
+                    cacheOpts.propfindTTL = 60;
+                    message = myName + " Init: option propfindTTL = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "goneTTL") // how long a 404/410 from the origin is remembered, 0: not at all
+            {
+                if (str2sec(value, &cacheOpts.goneTTL) != 0)
+                {
+                    cacheOpts.goneTTL = 60;
+                    message = myName + " Init: option goneTTL = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "unreachableTTL") // how long a failed origin check is remembered, 0: not at all
+            {
+                if (str2sec(value, &cacheOpts.unreachableTTL) != 0)
+                {
+                    cacheOpts.unreachableTTL = 30;
+                    message = myName + " Init: option unreachableTTL = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "refreshMode") // swap: keep serving a changed file until the new one is staged in
+            {
+                if (value == "purge" || value == "swap")
+                {
+                    cacheOpts.refreshMode = value;
+                }
+                else
+                {
+                    message = myName + " Init: option refreshMode = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "refreshStale") // longest the old copy is served with refreshMode=swap
+            {
+                if (str2sec(value, &cacheOpts.refreshStale) != 0)
+                {
+                    cacheOpts.refreshStale = 600;
+                    message = myName + " Init: option refreshStale = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "traceSample") // fraction of opens to trace, 0: no tracing
+            {
+                if (value.find_first_not_of("0123456789.") == std::string::npos &&
+                    atof(value.c_str()) >= 0 && atof(value.c_str()) <= 1)
+                {
+                    cacheOpts.traceSample = atof(value.c_str());
+                }
+                else
+                {
+                    message = myName + " Init: option traceSample = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "traceFile") // touch <traceFile>.trigger to write the traces here, required for tracing
+            {
+                cacheOpts.traceFile = value;
+            }
+            else if (key == "freshSnapshot") // file to keep the freshness table across restarts
+            {
+                cacheOpts.freshSnapshot = value;
+            }
+            else if (key == "freshSnapshotInterval")
+            {
+                if (str2sec(value, &cacheOpts.freshSnapshotInterval) != 0 || cacheOpts.freshSnapshotInterval <= 0)
+                {
+                    cacheOpts.freshSnapshotInterval = 300;
+                    message = myName + " Init: option freshSnapshotInterval = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "stageinOrder") // fifo (default), small, aged
+            {
+                if (value == "fifo" || value == "small" || value == "aged")
+                {
+                    cacheOpts.stageinOrder = value;
+                }
+                else
+                {
+                    message = myName + " Init: option stageinOrder = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "stageinStreams") // max parallel readers of a file with several replicas,
+                                              // > 1 costs a metalink GET per stage-in
+            {
+                if (value.find_first_not_of("0123456789") == std::string::npos && atoi(value.c_str()) > 0)
+                {
+                    cacheOpts.stageinStreams = atoi(value.c_str());
+                }
+                else
+                {
+                    message = myName + " Init: option stageinStreams = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "purgeMode") // async: purge in the background, rate limited
+            {
+                if (value == "sync" || value == "async")
+                {
+                    cacheOpts.purgeMode = value;
+                }
+                else
+                {
+                    message = myName + " Init: option purgeMode = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "purgeRate") // max purges per second with purgeMode=async
+            {
+                if (value.find_first_not_of("0123456789") == std::string::npos && atoi(value.c_str()) > 0)
+                {
+                    cacheOpts.purgeRate = atoi(value.c_str());
+                }
+                else
+                {
+                    message = myName + " Init: option purgeRate = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "purgePending") // open of a file being purged: stale or wait
+            {
+                if (value == "stale" || value == "wait")
+                {
+                    cacheOpts.purgePending = value;
+                }
+                else
+                {
+                    message = myName + " Init: option purgePending = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "purgeWait") // longest an open waits with purgePending=wait
+            {
+                if (str2sec(value, &cacheOpts.purgeWait) != 0)
+                {
+                    cacheOpts.purgeWait = 10;
+                    message = myName + " Init: option purgeWait = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "stageinWeights") // tenant:weight,... for stagein fair share, default weight 1
+            {
+                size_t i = 0, j, c;
+                int valid = 1;
+                while (i < value.length())
+                {
+                    j = value.find(",", i);
+                    if (j == std::string::npos) j = value.length();
+                    c = value.find(":", i);
+                    if (c == std::string::npos || c >= j || c == i || c == j -1 ||
+                        value.substr(c +1, j - c -1).find_first_not_of("0123456789") != std::string::npos ||
+                        atoi(value.substr(c +1, j - c -1).c_str()) <= 0)
+                        valid = 0;
+                    i = j +1;
+                }
+                if (valid)
+                {
+                    cacheOpts.stageinWeights = value;
+                }
+                else
+                {
+                    message = myName + " Init: option stageinWeights = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "stageinDiskPath") // file system holding the cache data, e.g. oss.localroot
+            {
+                cacheOpts.stageinDiskPath = value;
+            }
+            else if (key == "stageinDiskHigh") // fraction of stageinDiskPath stagein may fill, e.g. pfc.diskusage high
+            {
+                if (value.find_first_not_of("0123456789.") == std::string::npos && 
+                    atof(value.c_str()) > 0 && atof(value.c_str()) <= 1)
+                {
+                    cacheOpts.stageinDiskHigh = atof(value.c_str());
+                }
+                else
+                {
+                    message = myName + " Init: option stageinDiskHigh = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "redirectTTL") // longest a redirect of an origin check is reused, 0: never
+            {
+                if (str2sec(value, &cacheOpts.redirectTTL) != 0)
+                {
+                    message = myName + " Init: option redirectTTL = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
+            else if (key == "propfind") // 1: check freshness of a whole WebDAV collection at once
+            {
+                if (value == "0" || value == "1")
+                {
+                    cacheOpts.propfind = atoi(value.c_str());
+                }
+                else
+                {
+                    message = myName + " Init: option propfind = "
+                                     + value
+                                     + " is invalid";
+                    eDest->Say(message.c_str());
+                }
+            }
             key = "";
             value = "";  
             x = 0;
@@ -199,6 +511,56 @@ XrdOucName2NameXcacheH::XrdOucName2NameXcacheH(XrdSysError* erp, const char* con
                                                                      + ":"
                                                                      + std::to_string(cacheOpts.xrdPort);
     eDest->Say(message.c_str());
+    message = myName + " Init: effective option propfind = " + std::to_string(cacheOpts.propfind)
+                                                             + ", propfindTTL = "
+                                                             + std::to_string(cacheOpts.propfindTTL);
+    eDest->Say(message.c_str());
+    message = myName + " Init: effective option stageinLoopback = " + std::to_string(cacheOpts.stageinLoopback);
+    eDest->Say(message.c_str());
+    message = myName + " Init: effective option freshTableShm = " + cacheOpts.freshTableShm;
+    eDest->Say(message.c_str());
+    message = myName + " Init: effective option goneTTL = " + std::to_string(cacheOpts.goneTTL)
+                                                            + ", unreachableTTL = "
+                                                            + std::to_string(cacheOpts.unreachableTTL);
+    eDest->Say(message.c_str());
+    message = myName + " Init: effective option refreshMode = " + cacheOpts.refreshMode
+                                                                + ", refreshStale = "
+                                                                + std::to_string(cacheOpts.refreshStale);
+    eDest->Say(message.c_str());
+    if (cacheOpts.traceSample > 0 && cacheOpts.traceFile == "")
+    {
+        message = myName + " Init: option traceSample needs a traceFile, tracing is off";
+        eDest->Say(message.c_str());
+        cacheOpts.traceSample = 0;
+    }
+    message = myName + " Init: effective option traceSample = " + std::to_string(cacheOpts.traceSample)
+                                                                + ", traceFile = "
+                                                                + cacheOpts.traceFile;
+    eDest->Say(message.c_str());
+    message = myName + " Init: effective option freshSnapshot = " + cacheOpts.freshSnapshot
+                                                                  + ", freshSnapshotInterval = "
+                                                                  + std::to_string(cacheOpts.freshSnapshotInterval);
+    eDest->Say(message.c_str());
+    message = myName + " Init: effective option redirectTTL = " + std::to_string(cacheOpts.redirectTTL);
+    eDest->Say(message.c_str());
+    message = myName + " Init: effective option stageinOrder = " + cacheOpts.stageinOrder;
+    eDest->Say(message.c_str());
+    message = myName + " Init: effective option stageinWeights = " + cacheOpts.stageinWeights;
+    eDest->Say(message.c_str());
+    message = myName + " Init: effective option stageinStreams = " + std::to_string(cacheOpts.stageinStreams);
+    eDest->Say(message.c_str());
+    message = myName + " Init: effective option purgeMode = " + cacheOpts.purgeMode
+                                                              + ", purgeRate = "
+                                                              + std::to_string(cacheOpts.purgeRate)
+                                                              + ", purgePending = "
+                                                              + cacheOpts.purgePending
+                                                              + ", purgeWait = "
+                                                              + std::to_string(cacheOpts.purgeWait);
+    eDest->Say(message.c_str());
+    message = myName + " Init: effective option stageinDiskPath = " + cacheOpts.stageinDiskPath
+                                                                     + ", stageinDiskHigh = "
+                                                                     + std::to_string(cacheOpts.stageinDiskHigh);
+    eDest->Say(message.c_str());
 
 
     XcacheHInit(eDest, myName, &cacheOpts);
@@ -225,7 +587,9 @@ int XrdOucName2NameXcacheH::pfn2lfn(const char* pfn, char* buff, int blen)
         return 0;
     }
 
-    std::string myPath, myProt, myHostPort, myCGI;
+    XcacheHTraceRequest trace(myPfn);
+
+    std::string myPath, myProt, myHostPort, myCGI, myUser;
 
     // it is important to use string::rfind() to search from the end. <-- why?
     myPath = myUrl.substr(0, myUrl.find("?src="));
@@ -241,6 +605,9 @@ int XrdOucName2NameXcacheH::pfn2lfn(const char* pfn, char* buff, int blen)
     if (myUrl.find("@") != std::string::npos && 
         (myUrl.find("@") < myUrl.find("/") || myUrl.find("@") < myUrl.find("&")))
     {
+        // the user (without a password) is the tenant for stagein fair share
+        myUser = myUrl.substr(0, myUrl.find("@"));
+        myUser = myUser.substr(0, myUser.find(":"));
         myUrl.replace(0, myUrl.find("@") +1, "");
     }
     if (myUrl.find("&") != std::string::npos) // test '&'
@@ -257,6 +624,23 @@ int XrdOucName2NameXcacheH::pfn2lfn(const char* pfn, char* buff, int blen)
     std::string stageinToken = "xcachestagein";;
     int stageinRequest = 0;
 
+    // a reader of a parallel stage-in, filling the cache entry of the url
+    // being staged in (see XcacheHReplicaUrl())
+    std::string replicaToken = "xcachereplica=";
+    size_t i = myCGI.find(replicaToken);
+    if (i != std::string::npos && i > 0 && (myCGI[i -1] == '&' || myCGI[i -1] == '?'))
+    {
+        std::string id = myCGI.substr(i + replicaToken.length());
+        myLfn = XcacheHReplicaLfn(id.substr(0, id.find("&")));
+        if (myLfn != "")
+        {
+            blen = myLfn.length();
+            strncpy(buff, myLfn.c_str(), blen);
+            buff[blen] = 0;
+            return 0;
+        }
+    }
+
     if (myCGI.find(stageinToken + "=") != std::string::npos) // This is a stage in request
     {
         stageinRequest = 1;
@@ -295,7 +679,7 @@ int XrdOucName2NameXcacheH::pfn2lfn(const char* pfn, char* buff, int blen)
         return EINVAL; // see XrdOucName2Name.hh
     }
 
-    myLfn = XcacheHCheckFile(myUrl, stageinRequest);  
+    myLfn = XcacheHCheckFile(myUrl, stageinRequest, myUser);  
 
     if (myLfn == "EFAULT")
         return EFAULT;
@@ -0,0 +1,53 @@
+// Pruning of the url keyed maps of the request path (freshness table,
+// PROPFIND listings, redirects, negative results).
+//
+// Expired entries are dropped every BOUNDEDMAPPRUNE inserts instead of
+// scanning the map on every insert. If the map is still beyond its cap,
+// the entries that expire first are evicted down to 90% of the cap, so
+// the next full pass is at least cap/10 inserts away. The caller holds the
+// lock of the map.
+
+#include <time.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#define BOUNDEDMAPPRUNE 1000
+
+// expireT(value): when an entry expires
+template <class V, class F>
+void boundedMapPrune(std::map<std::string, V> &m, size_t cap, unsigned long *inserts, F expireT)
+{
+    typename std::map<std::string, V>::iterator it;
+    time_t currTime = time(NULL);
+
+    if (++(*inserts) % BOUNDEDMAPPRUNE != 0 && m.size() <= cap) return;
+
+    for (it = m.begin(); it != m.end(); )
+    {
+        if (expireT(it->second) < currTime)
+            m.erase(it++);
+        else
+            ++it;
+    }
+    if (m.size() <= cap) return;
+
+    std::vector<time_t> expires;
+    expires.reserve(m.size());
+    for (it = m.begin(); it != m.end(); ++it) expires.push_back(expireT(it->second));
+
+    size_t n = m.size() - cap / 10 * 9;
+    std::nth_element(expires.begin(), expires.begin() + (n -1), expires.end());
+    time_t limit = expires[n -1];
+    for (it = m.begin(); it != m.end() && n > 0; )
+    {
+        if (expireT(it->second) <= limit)
+        {
+            m.erase(it++);
+            n--;
+        }
+        else
+            ++it;
+    }
+}
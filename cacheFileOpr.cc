@@ -13,7 +13,7 @@ using namespace std;
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include "url2lfn.hh"
+#include "XcacheH.hh"
 #include "XrdVersion.hh"
 #include "XrdOuc/XrdOucCacheCM.hh"
 #include "XrdPosix/XrdPosixCache.hh"
@@ -38,29 +38,36 @@ XrdVERSIONINFO(XrdOucCacheCMInit,CacheCM-4-XcacheH);
 int cacheFileStat(std::string url, struct stat* myStat)
 {
     int rc;
-    char *lfn = url2lfn(url);
+    std::string lfn = XcacheHLfn(url);
 
-    rc = myCache->Stat(lfn, *myStat);
-    free(lfn);
+    rc = myCache->Stat(lfn.c_str(), *myStat);
     return rc;
 }
 
 int cacheFilePurge(std::string url)
 {
     int rc;
-    char *lfn = url2lfn(url);
+    std::string lfn = XcacheHLfn(url);
 
-    rc = myCache->Unlink(lfn); 
-    free(lfn);
+    rc = myCache->Unlink(lfn.c_str()); 
     return rc;
 }
 
+int cacheFilePurgeLfn(const std::string lfn)
+{
+    return myCache->Unlink(lfn.c_str());
+}
+
 int cacheFileQuery(std::string url)
 {
     int rc;
-    char *lfn = url2lfn(url);
+    std::string lfn = XcacheHLfn(url);
  
-    rc = myCache->CacheQuery(lfn, true);
-    free(lfn);
+    rc = myCache->CacheQuery(lfn.c_str(), true);
     return rc;
 }
+
+int cacheFileQueryLfn(const std::string lfn)
+{
+    return myCache->CacheQuery(lfn.c_str(), true);
+}
@@ -4,12 +4,16 @@
 
 #include <time.h>
 
-// url is in the form or /http:/host... or /https:/host
+// url is in the form or /http:/host... or /https:/host. The cache entry of
+// a url is the generation in use (see XcacheHLfn()), the ...Lfn() variants
+// name the entry directly.
 int cacheFileStat(std::string url, struct stat *myStat);
 
 // return 0 if file is purged, !0 if not
 int cacheFilePurge(std::string url);
+int cacheFilePurgeLfn(const std::string lfn);
 
 // return > 0 if file is fully cached, = 0 if partailly cache, < 0 if not exist
 // also extend the purge time
 int cacheFileQuery(std::string url);
+int cacheFileQueryLfn(const std::string lfn);
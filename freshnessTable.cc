@@ -0,0 +1,639 @@
+using namespace std;
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include "freshnessTable.hh"
+#include "boundedMap.hh"
+
+#define FRESHTABLEMAXSIZE 100000
+#define FRESHGENKEEP (30*86400)  // seconds an entry with a gen is kept after the check
+
+time_t freshTableTTL = 3600;
+std::map<std::string, struct freshEntry> freshTable;
+unsigned long freshTableInserts = 0;
+std::map<std::string, time_t> freshTableInflight;  // urls this process is asking for
+std::mutex freshTableMutex;
+std::condition_variable freshTableReleased;
+
+// The shared table: a file mmap'd by every process on the node. Each slot
+// is a seqlock (seq is odd while a writer owns the slot) holding the hash
+// of the url and what was learned about it, plus an in-flight marker: the
+// pid of the process asking the origin and the url it is asking for, in
+// one word, so that a marker never passes for one of another url that
+// takes over the slot. Readers never block; a reader that can't get a
+// consistent copy in a few tries treats the slot as a miss.
+
+#define FRESHSHMMAGIC 0x5863616368654835ULL  // "XcacheH5"
+#define FRESHSHMSLOTS 65536                // power of 2
+#define FRESHSHMPROBE 16
+#define FRESHSHMTRIES 100
+#define FRESHINFLIGHTMAX 200  // seconds, longer than a curl check may take
+#define FRESHPOLLINTERVAL 10000  // usec between looks at another process's marker
+
+struct freshSlot
+{
+    std::atomic<uint32_t> seq;
+    std::atomic<uint64_t> busy;     // pid << 32 | low 32 bits of the url hash, 0: none
+    std::atomic<uint64_t> urlHash;  // 0: free slot
+    std::atomic<int64_t> busyT;
+    std::atomic<int64_t> checkT;
+    std::atomic<int64_t> loMod;
+    std::atomic<int64_t> hiMod;
+    std::atomic<int64_t> size;
+    std::atomic<int64_t> ttl;
+    std::atomic<int64_t> gen;
+};
+
+struct freshShmHeader
+{
+    uint64_t magic;
+    uint64_t nSlots;
+};
+
+struct freshSlot *freshShm = NULL;
+
+// The snapshot: entries of the table written every snapInterval seconds to
+// a file sorted by url hash, so that a restarted process can mmap it and
+// binary search it on a miss. Only the pages looked at are ever read.
+
+#define FRESHSNAPMAGIC 0x5863616368655334ULL  // "XcacheS4"
+
+struct freshSnapRecord
+{
+    uint64_t urlHash;
+    int64_t checkT;
+    int64_t loMod;
+    int64_t hiMod;
+    int64_t size;
+    int64_t ttl;
+    int64_t gen;
+};
+
+struct freshSnapHeader
+{
+    uint64_t magic;
+    uint64_t nRecords;
+    int64_t writeT;
+};
+
+static bool operator<(const struct freshSnapRecord &a, const struct freshSnapRecord &b)
+{
+    return a.urlHash < b.urlHash;
+}
+
+std::string freshSnapFile;
+time_t freshSnapInterval = 300;
+const struct freshSnapRecord *freshSnap = NULL;  // the snapshot loaded at startup
+uint64_t freshSnapRecords = 0;
+
+// when an entry stops being trusted
+static time_t freshTrustT(const struct freshEntry &entry)
+{
+    return entry.checkT + (entry.ttl > 0? entry.ttl : freshTableTTL);
+}
+
+// when an entry may be dropped: the cache entry's gen must outlive the
+// checks of the origin file
+static time_t freshKeepT(const struct freshEntry &entry)
+{
+    time_t trustT = freshTrustT(entry);
+
+    if (entry.gen != 0 && entry.checkT + FRESHGENKEEP > trustT)
+        return entry.checkT + FRESHGENKEEP;
+    return trustT;
+}
+
+static std::string freshTableKey(const std::string url)
+{
+    return url.substr(0, url.find("?"));
+}
+
+static uint64_t freshTableHash(const std::string key)
+{
+    uint64_t h = 14695981039346656037ULL;  // FNV-1a
+
+    for (size_t i = 0; i < key.length(); i++)
+    {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return (h == 0? 1 : h);
+}
+
+#define SHMFIND  0  // only a slot holding the hash
+#define SHMCLAIM 1  // or a free slot
+#define SHMEVICT 2  // or a free slot, or the one checked longest ago
+
+static uint64_t shmBusyMark(uint64_t h, uint32_t pid)
+{
+    return ((uint64_t)pid << 32) | (h & 0xffffffffULL);
+}
+
+// a marker left by a process that died or hung is not live
+static bool shmBusyLive(struct freshSlot *slot, uint64_t busy)
+{
+    uint32_t pid = (uint32_t)(busy >> 32);
+
+    if (busy == 0) return false;
+    if ((time(NULL) - slot->busyT.load()) > FRESHINFLIGHTMAX) return false;
+    return (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+// Return a slot holding the hash, or NULL, see the modes above. A slot
+// with a live marker of another url is never evicted.
+static struct freshSlot *shmFindSlot(uint64_t h, int mode)
+{
+    struct freshSlot *slot, *oldest = NULL;
+    uint64_t slotHash, busy;
+    int i;
+
+    for (i = 0; i < FRESHSHMPROBE; i++)
+    {
+        slot = &freshShm[(h + i) & (FRESHSHMSLOTS -1)];
+        slotHash = slot->urlHash.load(std::memory_order_acquire);
+        if (slotHash == h) return slot;
+        if (slotHash == 0)
+        {
+            if (mode == SHMFIND) return NULL;
+            if (slot->urlHash.compare_exchange_strong(slotHash, h)) return slot;
+            if (slotHash == h) return slot;  // someone else just took it for us
+        }
+        busy = slot->busy.load();
+        if (shmBusyLive(slot, busy) && (busy & 0xffffffffULL) != (h & 0xffffffffULL)) continue;
+        if (oldest == NULL || slot->checkT.load(std::memory_order_relaxed) < oldest->checkT.load(std::memory_order_relaxed))
+            oldest = slot;
+    }
+    return (mode == SHMEVICT? oldest : NULL);
+}
+
+static bool shmWriteLock(struct freshSlot *slot, uint32_t *s)
+{
+    for (int i = 0; i < FRESHSHMTRIES; i++)
+    {
+        *s = slot->seq.load(std::memory_order_relaxed);
+        if ((*s & 1) == 0 && slot->seq.compare_exchange_weak(*s, *s +1, std::memory_order_acquire))
+            return true;
+        sched_yield();
+    }
+    return false;
+}
+
+static void shmUpdate(const std::string key, struct freshEntry *entry)
+{
+    uint64_t h = freshTableHash(key);
+    struct freshSlot *slot = shmFindSlot(h, SHMEVICT);
+    uint32_t s;
+
+    if (slot == NULL || ! shmWriteLock(slot, &s)) return;
+    if (slot->urlHash.load(std::memory_order_relaxed) != h)  // evict the previous owner
+    {
+        uint64_t busy = slot->busy.load();
+        if (shmBusyLive(slot, busy) && (busy & 0xffffffffULL) != (h & 0xffffffffULL))
+        {
+            slot->seq.store(s +2, std::memory_order_release);  // claimed meanwhile, leave it
+            return;
+        }
+        slot->urlHash.store(h, std::memory_order_relaxed);
+    }
+    slot->checkT.store(entry->checkT, std::memory_order_relaxed);
+    slot->loMod.store(entry->loMod, std::memory_order_relaxed);
+    slot->hiMod.store(entry->hiMod, std::memory_order_relaxed);
+    slot->size.store(entry->size, std::memory_order_relaxed);
+    slot->ttl.store(entry->ttl, std::memory_order_relaxed);
+    slot->gen.store(entry->gen, std::memory_order_relaxed);
+    slot->seq.store(s +2, std::memory_order_release);
+}
+
+static int shmGet(const std::string key, struct freshEntry *entry)
+{
+    uint64_t h = freshTableHash(key);
+    struct freshSlot *slot = shmFindSlot(h, SHMFIND);
+    uint32_t s;
+
+    if (slot == NULL) return -1;
+    for (int i = 0; i < FRESHSHMTRIES; i++)
+    {
+        s = slot->seq.load(std::memory_order_acquire);
+        if (s & 1) continue;
+        entry->checkT = slot->checkT.load(std::memory_order_relaxed);
+        entry->loMod = slot->loMod.load(std::memory_order_relaxed);
+        entry->hiMod = slot->hiMod.load(std::memory_order_relaxed);
+        entry->size = slot->size.load(std::memory_order_relaxed);
+        entry->ttl = slot->ttl.load(std::memory_order_relaxed);
+        entry->gen = slot->gen.load(std::memory_order_relaxed);
+        bool same = (slot->urlHash.load(std::memory_order_relaxed) == h);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->seq.load(std::memory_order_relaxed) == s)
+            return ((same && entry->checkT != 0)? 0 : -1);
+    }
+    return -1;
+}
+
+static int snapGet(const std::string key, struct freshEntry *entry)
+{
+    struct freshSnapRecord rec;
+
+    if (freshSnap == NULL) return -1;
+    rec.urlHash = freshTableHash(key);
+    const struct freshSnapRecord *r = std::lower_bound(freshSnap, freshSnap + freshSnapRecords, rec);
+    if (r == freshSnap + freshSnapRecords || r->urlHash != rec.urlHash) return -1;
+
+    entry->checkT = r->checkT;
+    entry->loMod = r->loMod;
+    entry->hiMod = r->hiMod;
+    entry->size = r->size;
+    entry->ttl = r->ttl;
+    entry->gen = r->gen;
+    entry->etag = "";
+    entry->digest = "";
+    return 0;
+}
+
+static int snapLoad(const std::string snapFile)
+{
+    struct freshSnapHeader *header;
+    struct stat st;
+    void *addr;
+    int fd, rc = 0;
+
+    fd = open(snapFile.c_str(), O_RDONLY);
+    if (fd < 0) return (errno == ENOENT? 0 : -errno);  // first start
+
+    if (fstat(fd, &st) != 0)
+        rc = -errno;
+    else if ((size_t)st.st_size < sizeof(struct freshSnapHeader))
+        rc = -EINVAL;
+    else if ((addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        rc = -errno;
+    else
+    {
+        header = (struct freshSnapHeader*)addr;
+        if (header->magic != FRESHSNAPMAGIC ||
+            (size_t)st.st_size != sizeof(struct freshSnapHeader) + header->nRecords * sizeof(struct freshSnapRecord))
+        {
+            munmap(addr, st.st_size);
+            rc = -EINVAL;
+        }
+        else
+        {
+            freshSnapRecords = header->nRecords;
+            freshSnap = (struct freshSnapRecord*)(header +1);
+        }
+    }
+    close(fd);  // the mapping stays
+    return rc;
+}
+
+// Write the entries still trusted (or holding a gen), from the table and from the loaded
+// snapshot, to a new file and rename it over the old one. The loaded
+// snapshot stays mapped (the old file is only unlinked).
+static int snapWrite()
+{
+    struct freshSnapHeader header;
+    std::vector<struct freshSnapRecord> recs;
+    struct freshSnapRecord rec;
+    time_t currTime = time(NULL);
+    uint64_t i;
+
+    {
+        std::lock_guard<std::mutex> guard(freshTableMutex);
+        recs.reserve(freshTable.size() + freshSnapRecords);
+        for (std::map<std::string, struct freshEntry>::iterator it = freshTable.begin(); it != freshTable.end(); ++it)
+        {
+            if (freshKeepT(it->second) < currTime) continue;
+            rec.urlHash = freshTableHash(it->first);
+            rec.checkT = it->second.checkT;
+            rec.loMod = it->second.loMod;
+            rec.hiMod = it->second.hiMod;
+            rec.size = it->second.size;
+            rec.ttl = it->second.ttl;
+            rec.gen = it->second.gen;
+            recs.push_back(rec);
+        }
+    }
+    for (i = 0; i < freshSnapRecords; i++)
+    {
+        struct freshEntry entry;
+        entry.checkT = freshSnap[i].checkT;
+        entry.ttl = freshSnap[i].ttl;
+        entry.gen = freshSnap[i].gen;
+        if (freshKeepT(entry) >= currTime) recs.push_back(freshSnap[i]);
+    }
+
+    // the table's entries come first, so they are kept over the snapshot's
+    std::stable_sort(recs.begin(), recs.end());
+    recs.erase(std::unique(recs.begin(), recs.end(),
+                           [](const struct freshSnapRecord &a, const struct freshSnapRecord &b)
+                           { return a.urlHash == b.urlHash; }),
+               recs.end());
+
+    header.magic = FRESHSNAPMAGIC;
+    header.nRecords = recs.size();
+    header.writeT = currTime;
+
+    // a temporary file of its own next to the target, so that processes
+    // writing at the same time never write into the same file
+    std::string tmpFile = freshSnapFile + ".XXXXXX";
+    std::vector<char> tmpName(tmpFile.begin(), tmpFile.end());
+    tmpName.push_back(0);
+    int fd = mkstemp(tmpName.data());
+    if (fd < 0) return -errno;
+    tmpFile = tmpName.data();
+
+    size_t len = recs.size() * sizeof(struct freshSnapRecord);
+    int rc = 0;
+    errno = 0;
+    if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ||
+        (len > 0 && write(fd, recs.data(), len) != (ssize_t)len) ||
+        fchmod(fd, 0644) != 0 || fsync(fd) != 0)
+        rc = (errno != 0? -errno : -EIO);
+    if (close(fd) != 0 && rc == 0)
+        rc = -errno;
+    if (rc == 0 && rename(tmpFile.c_str(), freshSnapFile.c_str()) != 0)
+        rc = -errno;
+    if (rc != 0) unlink(tmpFile.c_str());
+    return rc;
+}
+
+static void snapWriter()
+{
+    while (1)
+    {
+        sleep(freshSnapInterval);
+        snapWrite();
+    }
+}
+
+static int shmInit(const std::string shmFile)
+{
+    size_t len = sizeof(struct freshShmHeader) + FRESHSHMSLOTS * sizeof(struct freshSlot);
+    struct freshShmHeader *header;
+    struct stat st;
+    void *addr;
+    int fd, rc = 0;
+
+    // the verdicts in it are trusted, so it must be a file of this account
+    // that no one else can write to, not something planted (e.g. in /dev/shm)
+    fd = open(shmFile.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+    if (fd < 0) return -errno;
+
+    flock(fd, LOCK_EX);  // the first process on the node sizes the file
+    if (fstat(fd, &st) != 0)
+        rc = -errno;
+    else if (! S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+        rc = -EPERM;
+    else if (st.st_size == 0 && ftruncate(fd, len) != 0)
+        rc = -errno;
+    else if (st.st_size != 0 && (size_t)st.st_size != len)
+        rc = -EINVAL;
+
+    if (rc == 0)
+    {
+        addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED)
+            rc = -errno;
+        else
+        {
+            header = (struct freshShmHeader*)addr;
+            if (header->magic == 0)
+            {
+                header->nSlots = FRESHSHMSLOTS;
+                header->magic = FRESHSHMMAGIC;
+            }
+            if (header->magic != FRESHSHMMAGIC || header->nSlots != FRESHSHMSLOTS)
+            {
+                munmap(addr, len);
+                rc = -EINVAL;
+            }
+            else
+                freshShm = (struct freshSlot*)(header +1);
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);  // the mapping stays
+    return rc;
+}
+
+int freshTableInit(time_t ttl, const std::string shmFile)
+{
+    freshTableTTL = ttl;
+    if (shmFile == "") return 0;
+    return shmInit(shmFile);
+}
+
+int freshTableSnapshotInit(const std::string snapFile, time_t interval)
+{
+    if (snapFile == "") return 0;
+    freshSnapFile = snapFile;
+    freshSnapInterval = interval;
+
+    int rc = snapLoad(snapFile);
+    std::thread writer(snapWriter);
+    writer.detach();
+    return rc;
+}
+
+// The latest entry of the table, the snapshot and the shared table,
+// trusted or not. Return 0 or -1 if there is none.
+static int freshTableFind(const std::string key, struct freshEntry *entry)
+{
+    struct freshEntry shmEntry;
+    int rc = -1;
+
+    {
+        std::lock_guard<std::mutex> guard(freshTableMutex);
+        std::map<std::string, struct freshEntry>::iterator it = freshTable.find(key);
+        if (it != freshTable.end())
+        {
+            *entry = it->second;
+            rc = 0;
+        }
+    }
+    // what was known before the restart
+    if (rc != 0 && snapGet(key, entry) == 0) rc = 0;
+
+    // another process on this node may know better
+    if (freshShm != NULL && shmGet(key, &shmEntry) == 0 && (rc != 0 || shmEntry.checkT > entry->checkT))
+    {
+        *entry = shmEntry;
+        rc = 0;
+    }
+    return rc;
+}
+
+static void freshTableStore(const std::string key, struct freshEntry *entry)
+{
+    if (freshShm != NULL) shmUpdate(key, entry);
+
+    std::lock_guard<std::mutex> guard(freshTableMutex);
+
+    boundedMapPrune(freshTable, FRESHTABLEMAXSIZE, &freshTableInserts, freshKeepT);
+    freshTable[key] = *entry;
+}
+
+void freshTableUpdate(const std::string url, struct freshEntry *entry)
+{
+    std::string key = freshTableKey(url);
+    struct freshEntry last;
+
+    // a check of the origin doesn't change which cache entry is in use
+    if (entry->gen == 0 && freshTableFind(key, &last) == 0) entry->gen = last.gen;
+    freshTableStore(key, entry);
+}
+
+void freshTableSetGen(const std::string url, long long gen)
+{
+    std::string key = freshTableKey(url);
+    struct freshEntry entry;
+
+    if (freshTableFind(key, &entry) != 0)
+    {
+        // nothing known about the origin file: it was modified in (0, now]
+        entry.checkT = time(NULL);
+        entry.loMod = 0;
+        entry.hiMod = entry.checkT;
+        entry.size = -1;
+        entry.ttl = 0;
+        entry.etag = entry.digest = "";
+    }
+    entry.gen = gen;
+    freshTableStore(key, &entry);
+}
+
+long long freshTableGen(const std::string url)
+{
+    struct freshEntry entry;
+
+    return (freshTableFind(freshTableKey(url), &entry) == 0? entry.gen : 0);
+}
+
+int freshTableGet(const std::string url, struct freshEntry *entry)
+{
+    if (freshTableFind(freshTableKey(url), entry) != 0 || freshTrustT(*entry) < time(NULL))
+        return -1;
+    return 0;
+}
+
+int freshTableLast(const std::string url, struct freshEntry *entry)
+{
+    std::string key = freshTableKey(url);
+    {
+        std::lock_guard<std::mutex> guard(freshTableMutex);
+        std::map<std::string, struct freshEntry>::iterator it = freshTable.find(key);
+
+        if (it != freshTable.end())
+        {
+            *entry = it->second;
+            return 0;
+        }
+    }
+    return snapGet(key, entry);
+}
+
+int freshTableVerdict(const std::string url, time_t mTime)
+{
+    struct freshEntry entry;
+
+    if (freshTableGet(url, &entry) != 0) return -1;
+
+    if (entry.hiMod <= mTime) return 0;
+    if (entry.loMod >= mTime) return 1;
+    return -1;
+}
+
+int freshTableClaim(const std::string url)
+{
+    std::string key = freshTableKey(url);
+    time_t currTime = time(NULL);
+
+    // with no slot to put the marker in (the probe window is full of other
+    // urls), fall back to the in-flight marker of this process
+    if (freshShm != NULL)
+    {
+        uint64_t h = freshTableHash(key);
+        uint64_t mine = shmBusyMark(h, (uint32_t)getpid());
+        struct freshSlot *slot = shmFindSlot(h, SHMCLAIM);
+
+        if (slot != NULL)
+        {
+            uint64_t busy = slot->busy.load();
+            if (shmBusyLive(slot, busy))
+            {
+                if ((busy & 0xffffffffULL) == (h & 0xffffffffULL)) return 0;
+            }
+            else
+            {
+                slot->busyT.store(currTime);
+                if (slot->busy.compare_exchange_strong(busy, mine))
+                {
+                    std::lock_guard<std::mutex> guard(freshTableMutex);
+                    freshTableInflight[key] = currTime;
+                    return 1;
+                }
+                if ((busy & 0xffffffffULL) == (h & 0xffffffffULL)) return 0;  // just claimed by another
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(freshTableMutex);
+    std::map<std::string, time_t>::iterator it = freshTableInflight.find(key);
+    if (it != freshTableInflight.end() && (currTime - it->second) <= FRESHINFLIGHTMAX)
+        return 0;
+    freshTableInflight[key] = currTime;
+    return 1;
+}
+
+void freshTableRelease(const std::string url)
+{
+    std::string key = freshTableKey(url);
+
+    if (freshShm != NULL)
+    {
+        // the marker may be in a slot that now holds another url
+        uint64_t h = freshTableHash(key);
+        uint64_t mine = shmBusyMark(h, (uint32_t)getpid());
+        for (int i = 0; i < FRESHSHMPROBE; i++)
+        {
+            uint64_t busy = mine;
+            if (freshShm[(h + i) & (FRESHSHMSLOTS -1)].busy.compare_exchange_strong(busy, 0)) break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(freshTableMutex);
+        freshTableInflight.erase(key);
+    }
+    freshTableReleased.notify_all();
+}
+
+void freshTableWait(const std::string url)
+{
+    std::string key = freshTableKey(url);
+    std::unique_lock<std::mutex> lock(freshTableMutex);
+
+    if (freshTableInflight.find(key) != freshTableInflight.end())
+    {
+        freshTableReleased.wait_for(lock, std::chrono::seconds(1),
+                                    [&key] { return freshTableInflight.find(key) == freshTableInflight.end(); });
+        return;
+    }
+    lock.unlock();
+    usleep(FRESHPOLLINTERVAL);
+}
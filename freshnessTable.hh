@@ -0,0 +1,83 @@
+// In-memory table of what is known about origin files, keyed by the url
+// without CGI (the same way url2lfn() names the cache entry).
+//
+// The origin modification time is only known to lie in (loMod, hiMod]:
+// a Last-Modified of T gives (T-1, T], a 304 to If-Modified-Since: M gives
+// (0, M], a 200 gives (M, checkT]. This is enough to decide freshness of
+// a cached copy with any mtime, no matter how the entry was learned.
+//
+// With a shmFile, the table (except etag and digest) is also kept in a file mmap'd by
+// every process on the node using this plugin, so they share one view and
+// one in-flight marker per url. It is created 0600 and only used if it is a
+// regular file (not a symlink) of this account that group and others can't
+// write to.
+//
+// With a snapshot file, the trusted entries (except etag and digest) are
+// written to it periodically, sorted by url hash. At startup the previous
+// snapshot is mmap'd, not read, and binary searched when the table has no
+// entry, so the first opens after a restart don't all go to the origin.
+//
+// gen is about the cache entry, not the origin: which generation of the
+// cache entry of the url is in use (see refreshMode=swap in XcacheH.cc).
+// It is carried over to the later entries of the url, and an entry with a
+// gen is kept for FRESHGENKEEP after the check even when no longer trusted,
+// in the shared table and the snapshot too.
+
+#include <time.h>
+#include <string>
+
+struct freshEntry
+{
+    time_t checkT;     // when the origin was asked
+    time_t loMod;
+    time_t hiMod;
+    long long size;    // -1 if unknown
+    time_t ttl;        // trusted for ttl seconds after checkT, 0: the table's ttl
+    long long gen;     // generation of the cache entry in use, 0: the first
+    std::string etag;  // empty if unknown
+    std::string digest;  // RFC 3230 Digest, empty if unknown
+};
+
+// entries are trusted for ttl seconds after checkT, unless they have their
+// own ttl. Return 0 or -errno
+// if the shmFile can not be used (the table is then process local).
+int freshTableInit(time_t ttl, const std::string shmFile);
+
+// load snapFile if there is one and rewrite it every interval seconds.
+// Return 0 or -errno if the previous snapshot can not be used.
+int freshTableSnapshotInit(const std::string snapFile, time_t interval);
+
+// entry->gen 0 keeps the gen the url has
+void freshTableUpdate(const std::string url, struct freshEntry *entry);
+
+// switch url to generation gen of its cache entry, and the gen of url
+// (0 if it has none)
+void freshTableSetGen(const std::string url, long long gen);
+long long freshTableGen(const std::string url);
+
+// Return
+// 0: an entry exists and is still trusted,
+// -1: no (trusted) entry
+int freshTableGet(const std::string url, struct freshEntry *entry);
+
+// Same as freshTableGet() but also return entries no longer trusted, to
+// compare validators with those seen last time.
+int freshTableLast(const std::string url, struct freshEntry *entry);
+
+// Return
+// 0: data source hasn't changed since mTime
+// 1: data source was modified after mTime
+// -1: unknown, the origin has to be asked
+int freshTableVerdict(const std::string url, time_t mTime);
+
+// Return
+// 1: the caller should ask the origin, and call freshTableRelease() after
+// 0: someone (maybe in another process) is already asking
+int freshTableClaim(const std::string url);
+
+void freshTableRelease(const std::string url);
+
+// Wait a little for someone else's check of url (freshTableClaim() returned
+// 0): until it is released if this process is asking, for up to a second,
+// otherwise 10 msec, to look at another process's marker again.
+void freshTableWait(const std::string url);
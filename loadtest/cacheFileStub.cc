@@ -0,0 +1,92 @@
+// Stand-in for cacheFileOpr.cc when the plugin runs outside xrootd, used by
+// xcachehLoad. Cache entries live in a map keyed by lfn. The first time an
+// lfn is seen it is made cached (fully) with probability stubCachedFraction,
+// with an atime old enough to make every open check the origin. A purge
+// behaves as if the file was fetched again right away.
+
+using namespace std;
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <string>
+#include <map>
+#include <mutex>
+#include <functional>
+
+#include "XcacheH.hh"
+#include "cacheFileOpr.hh"
+
+struct stubEntry
+{
+    int cached;  // 1 full, -1 not cached
+    time_t mTime;
+    off_t size;
+};
+
+double stubCachedFraction = 1.0;
+static std::map<std::string, struct stubEntry> stubCache;
+static std::mutex stubMutex;
+
+static struct stubEntry *stubFind(const std::string lfn)
+{
+    std::map<std::string, struct stubEntry>::iterator it = stubCache.find(lfn);
+    if (it != stubCache.end()) return &it->second;
+
+    struct stubEntry entry;
+    entry.cached = ((std::hash<std::string>()(lfn) % 1000) < stubCachedFraction * 1000? 1 : -1);
+    entry.mTime = time(NULL) - 86400;
+    entry.size = 1048576;
+    stubCache[lfn] = entry;
+    return &stubCache[lfn];
+}
+
+int cacheFileStat(std::string url, struct stat *myStat)
+{
+    std::lock_guard<std::mutex> guard(stubMutex);
+    struct stubEntry *entry = stubFind(XcacheHLfn(url));
+
+    if (entry->cached < 0) return -ENOENT;
+    memset(myStat, 0, sizeof(struct stat));
+    myStat->st_mtime = entry->mTime;
+    myStat->st_atime = 0;
+    myStat->st_size = entry->size;
+    return 0;
+}
+
+int cacheFilePurge(std::string url)
+{
+    std::lock_guard<std::mutex> guard(stubMutex);
+    struct stubEntry *entry = stubFind(XcacheHLfn(url));
+
+    entry->mTime = time(NULL);
+    return 0;
+}
+
+int cacheFilePurgeLfn(const std::string lfn)
+{
+    std::lock_guard<std::mutex> guard(stubMutex);
+    struct stubEntry *entry = stubFind(lfn);
+
+    entry->mTime = time(NULL);
+    return 0;
+}
+
+int cacheFileQuery(std::string url)
+{
+    std::lock_guard<std::mutex> guard(stubMutex);
+    struct stubEntry *entry = stubFind(XcacheHLfn(url));
+
+    return entry->cached;
+}
+
+int cacheFileQueryLfn(const std::string lfn)
+{
+    std::lock_guard<std::mutex> guard(stubMutex);
+    struct stubEntry *entry = stubFind(lfn);
+
+    return entry->cached;
+}
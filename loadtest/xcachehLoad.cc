@@ -0,0 +1,286 @@
+// xcachehLoad: replay recorded open urls into XrdOucName2NameXcacheH::pfn2lfn()
+// from N threads and report open throughput and tail latency vs. threads.
+//
+// The plugin runs against cacheFileStub.cc instead of a real Pfc, and by
+// default against a local HTTP origin stub: the scheme and host of every
+// url are replaced by the stub's. Build with "make xcachehLoad".
+//
+// usage: xcachehLoad -f urlFile [-t 1,2,4,8,16,32] [-n opens per run]
+//                    [-L origin latency ms] [-e origin error rate]
+//                    [-m 304 fraction] [-c cached fraction]
+//                    [-p "plugin options"] [-u]
+//
+//   urlFile  one url per line (http://host/path?cgi), as in an access log
+//   -u       send the checks to the real origins in the urls, no stub
+//
+// Every row (thread count) runs in a child process of its own with a new
+// plugin instance, so each starts with cold in-memory tables (freshness,
+// redirects, negative outcomes) instead of what the rows before it left.
+// A freshTableShm or snapshot file given in -p is still shared, as it
+// would be by the processes of a real server. The origin stub keeps
+// running in the parent.
+//
+// Log level is taken from XcacheH_DBG as usual (default here: 0).
+
+using namespace std;
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+
+#include "XrdOuc/XrdOucName2Name.hh"
+#include "XrdSys/XrdSysError.hh"
+#include "XrdSys/XrdSysLogger.hh"
+
+extern double stubCachedFraction;
+
+static int originLatency = 5;      // ms
+static double originErrors = 0.01;
+static double origin304 = 0.9;
+
+// ---------------------------------------------------------------------------
+// HTTP origin stub: one thread per connection, one request per connection.
+// ---------------------------------------------------------------------------
+
+static void originServe(int fd, unsigned int seed)
+{
+    std::mt19937 rnd(seed);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
+    std::string req, resp;
+    char buff[4096], date[64];
+    ssize_t n;
+    size_t hdrEnd;
+
+    while ((hdrEnd = req.find("\r\n\r\n")) == std::string::npos &&
+           (n = read(fd, buff, sizeof(buff))) > 0)
+        req.append(buff, n);
+
+    // drop a request body (PROPFIND)
+    size_t i = req.find("\r\nContent-Length:");
+    if (hdrEnd != std::string::npos && i != std::string::npos && i < hdrEnd)
+    {
+        size_t len = atol(req.c_str() + i + 17);
+        size_t have = req.length() - hdrEnd - 4;
+        while (have < len && (n = read(fd, buff, sizeof(buff))) > 0) have += n;
+    }
+
+    usleep(originLatency * 1000);
+
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&now));
+
+    if (req.find("PROPFIND") == 0)
+        resp = "HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\n";
+    else if (coin(rnd) < originErrors)
+        resp = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n";
+    else if (coin(rnd) < origin304)
+        resp = "HTTP/1.1 304 Not Modified\r\n";
+    else
+        resp = std::string("HTTP/1.1 200 OK\r\nLast-Modified: ") + date + "\r\nContent-Length: 1048576\r\n";
+    resp += "Connection: close\r\n\r\n";
+
+    n = write(fd, resp.c_str(), resp.length());
+    close(fd);
+}
+
+static int originStart()
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd, on = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 1024) != 0)
+    {
+        perror("origin stub");
+        exit(1);
+    }
+    getsockname(fd, (struct sockaddr*)&addr, &len);
+
+    std::thread acceptor([fd] {
+        unsigned int seed = 0;
+        int cfd;
+        while ((cfd = accept(fd, NULL, NULL)) >= 0)
+        {
+            std::thread conn(originServe, cfd, seed++);
+            conn.detach();
+        }
+    });
+    acceptor.detach();
+    return ntohs(addr.sin_port);
+}
+
+// ---------------------------------------------------------------------------
+// Replay
+// ---------------------------------------------------------------------------
+
+// http://user@host:port/path?cgi -> /path?src=http://user@host:port&cgi
+// (what pss hands to pfn2lfn() with "pss.namelib -lfncachesrc+")
+static std::string url2pfn(std::string url, std::string origin)
+{
+    size_t p = url.find("://");
+    if (p == std::string::npos) return "";
+    size_t s = url.find("/", p +3);
+    std::string prot = url.substr(0, p +3);
+    std::string host = url.substr(p +3, (s == std::string::npos? url.length() : s) - p -3);
+    std::string path = (s == std::string::npos? "/" : url.substr(s));
+    std::string cgi;
+
+    if (path.find("?") != std::string::npos)
+    {
+        cgi = "&" + path.substr(path.find("?") +1);
+        path = path.substr(0, path.find("?"));
+    }
+    if (origin != "")
+    {
+        prot = "http://";
+        host = origin;
+    }
+    return path + "?src=" + prot + host + cgi;
+}
+
+static double percentile(std::vector<double> &lat, double p)
+{
+    if (lat.empty()) return 0;
+    size_t i = (size_t)(p * (lat.size() -1));
+    return lat[i];
+}
+
+static void runOnce(XrdOucName2Name *n2n, std::vector<std::string> &pfns, int nThreads, long nOpens)
+{
+    std::vector<std::vector<double> > lats(nThreads);
+    std::vector<std::thread> threads;
+    std::atomic<long> next(0);
+    std::atomic<long> errors(0);
+
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    for (int t = 0; t < nThreads; t++)
+    {
+        threads.push_back(std::thread([&, t] {
+            char buff[4096];
+            long i;
+            while ((i = next++) < nOpens)
+            {
+                const std::string &pfn = pfns[i % pfns.size()];
+                std::chrono::steady_clock::time_point s = std::chrono::steady_clock::now();
+                if (n2n->pfn2lfn(pfn.c_str(), buff, sizeof(buff)) != 0) errors++;
+                std::chrono::duration<double, std::milli> d = std::chrono::steady_clock::now() - s;
+                lats[t].push_back(d.count());
+            }
+        }));
+    }
+    for (int t = 0; t < nThreads; t++) threads[t].join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+
+    std::vector<double> all;
+    for (int t = 0; t < nThreads; t++) all.insert(all.end(), lats[t].begin(), lats[t].end());
+    std::sort(all.begin(), all.end());
+
+    printf("%7d %8ld %8.2f %10.1f %8.2f %8.2f %8.2f %8.2f %9.2f %6ld\n",
+           nThreads, (long)all.size(), elapsed.count(), all.size() / elapsed.count(),
+           percentile(all, 0.5), percentile(all, 0.9), percentile(all, 0.99), percentile(all, 0.999),
+           (all.empty()? 0 : all.back()), (long)errors);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    std::string urlFile, threadList = "1,2,4,8,16,32", parms = "cacheLife=1s", origin;
+    long nOpens = 10000;
+    bool useStub = true;
+    int c;
+
+    while ((c = getopt(argc, argv, "f:t:n:L:e:m:c:p:u")) != -1)
+    {
+        switch (c)
+        {
+            case 'f': urlFile = optarg; break;
+            case 't': threadList = optarg; break;
+            case 'n': nOpens = atol(optarg); break;
+            case 'L': originLatency = atoi(optarg); break;
+            case 'e': originErrors = atof(optarg); break;
+            case 'm': origin304 = atof(optarg); break;
+            case 'c': stubCachedFraction = atof(optarg); break;
+            case 'p': parms = optarg; break;
+            case 'u': useStub = false; break;
+            default:
+                fprintf(stderr, "see the comments at the top of xcachehLoad.cc for usage\n");
+                return 1;
+        }
+    }
+    if (urlFile == "")
+    {
+        fprintf(stderr, "usage: %s -f urlFile [options]\n", argv[0]);
+        return 1;
+    }
+
+    if (useStub) origin = "127.0.0.1:" + std::to_string(originStart());
+
+    std::vector<std::string> pfns;
+    std::ifstream in(urlFile.c_str());
+    std::string line;
+    while (std::getline(in, line))
+    {
+        line = url2pfn(line, origin);
+        if (line != "") pfns.push_back(line);
+    }
+    if (pfns.empty())
+    {
+        fprintf(stderr, "no url in %s\n", urlFile.c_str());
+        return 1;
+    }
+
+    setenv("XRDPORT", "1094", 0);
+    setenv("XcacheH_DBG", "0", 0);
+    printf("# %zu urls, origin %s, latency %d ms, errors %.3f, 304 %.2f, cached %.2f\n",
+           pfns.size(), (useStub? origin.c_str() : "real"), originLatency, originErrors, origin304,
+           stubCachedFraction);
+    printf("# threads    opens  seconds    opens/s   p50 ms   p90 ms   p99 ms p99.9 ms    max ms errors\n");
+
+    size_t i = 0, j;
+    int status;
+    pid_t pid;
+    while (i < threadList.length())
+    {
+        j = threadList.find(",", i);
+        if (j == std::string::npos) j = threadList.length();
+
+        fflush(stdout);
+        if ((pid = fork()) == 0)
+        {
+            XrdSysLogger logger;
+            XrdSysError eDest(&logger, "xcachehLoad");
+            XrdOucName2Name *n2n = XrdOucgetName2Name(&eDest, NULL, parms.c_str(), NULL, NULL);
+
+            runOnce(n2n, pfns, atoi(threadList.substr(i, j - i).c_str()), nOpens);
+            fflush(stdout);
+            _exit(0);  // the plugin's threads are still running, skip the destructors
+        }
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || ! WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "run with %s threads failed\n", threadList.substr(i, j - i).c_str());
+            return 1;
+        }
+        i = j +1;
+    }
+    return 0;
+}
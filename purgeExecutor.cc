@@ -0,0 +1,150 @@
+using namespace std;
+
+#include <errno.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <list>
+#include <map>
+
+#include "XcacheH.hh"
+#include "purgeExecutor.hh"
+#include "stagein.hh"
+#include "cacheFileOpr.hh"
+#include "XcacheHLog.hh"
+
+static int purgeMode;  // 0: sync, 1: async
+static int purgeRate;  // unlinks per second
+static int purgeStale;  // 1: serve pending files stale, 0: wait for the purge
+static time_t purgeWaitT;
+
+// pending purges, keyed by the url without CGI (as the cache entry is named)
+std::list<std::string> purgeQueue;
+std::map<std::string, int> purgeInflight;  // 0: queued, 1: being unlinked
+std::map<std::string, std::pair<std::string, std::string> > purgeStageins;  // key -> url, tenant to stage in after
+std::mutex purgeMutex;
+std::condition_variable purgeQueued, purgeDone;
+
+static std::string purgeKey(const std::string myPfn)
+{
+    return myPfn.substr(0, myPfn.find("?"));
+}
+
+static void purgeOne(std::string myPfn)
+{
+    int rc = cacheFilePurge(myPfn);
+    const char *msg;
+
+    if (rc == 0)
+        msg = "purge";
+    // a purge that fails is not retried, the next open checks the file again
+    else if (rc == -EBUSY)
+        msg = "not purge, in use!";
+    else if (rc == -EAGAIN)
+        msg = "not purge, file subject to internal processing!";
+    else
+        msg = "fail to purge";
+    XcacheHLog((rc == 0? XCACHEH_LOG_INFO : XCACHEH_LOG_ERR), msg, myPfn);
+}
+
+static void purgeExecutor()
+{
+    std::list<std::string> batch;
+
+    while (1)
+    {
+        {
+            std::unique_lock<std::mutex> lock(purgeMutex);
+            while (purgeQueue.empty()) purgeQueued.wait(lock);
+
+            for (int i = 0; i < purgeRate && ! purgeQueue.empty(); i++)
+            {
+                batch.push_back(purgeQueue.front());
+                purgeInflight[purgeQueue.front()] = 1;
+                purgeQueue.pop_front();
+            }
+            XcacheHLogNum(XCACHEH_LOG_DBG, "purge batch of %d, %d left", "", batch.size(), purgeQueue.size());
+        }
+
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        while (! batch.empty())
+        {
+            std::pair<std::string, std::string> stagein;
+
+            purgeOne(batch.front());
+            {
+                std::lock_guard<std::mutex> guard(purgeMutex);
+                purgeInflight.erase(batch.front());
+                std::map<std::string, std::pair<std::string, std::string> >::iterator it = purgeStageins.find(batch.front());
+                if (it != purgeStageins.end())
+                {
+                    stagein = it->second;
+                    purgeStageins.erase(it);
+                }
+            }
+            purgeDone.notify_all();
+            if (stagein.first != "") addToStageinList(stagein.first, stagein.second);
+            batch.pop_front();
+        }
+        // a batch per second at most
+        std::this_thread::sleep_until(t0 + std::chrono::seconds(1));
+    }
+}
+
+void purgeInit(struct cacheOptions *cacheOpts)
+{
+    purgeMode = (cacheOpts->purgeMode == "async"? 1 : 0);
+    purgeRate = cacheOpts->purgeRate;
+    purgeStale = (cacheOpts->purgePending == "stale"? 1 : 0);
+    purgeWaitT = cacheOpts->purgeWait;
+
+    if (purgeMode == 0) return;
+    std::thread executor(purgeExecutor);
+    executor.detach();
+}
+
+int purgeAsync()
+{
+    return purgeMode;
+}
+
+int purgeSubmit(std::string myPfn)
+{
+    std::string key = purgeKey(myPfn);
+    {
+        std::lock_guard<std::mutex> guard(purgeMutex);
+        if (purgeInflight.find(key) != purgeInflight.end()) return 0;
+        purgeInflight[key] = 0;
+        purgeQueue.push_back(key);
+    }
+    purgeQueued.notify_one();
+    return 1;
+}
+
+int purgeHoldStagein(std::string myPfn, const std::string tenant)
+{
+    std::string key = purgeKey(myPfn);
+    std::lock_guard<std::mutex> guard(purgeMutex);
+
+    if (purgeInflight.find(key) == purgeInflight.end()) return 0;
+    purgeStageins[key] = std::make_pair(myPfn, tenant);
+    return 1;
+}
+
+int purgeRoute(std::string myPfn)
+{
+    if (purgeMode == 0) return 0;
+
+    std::string key = purgeKey(myPfn);
+    std::unique_lock<std::mutex> lock(purgeMutex);
+
+    if (purgeInflight.find(key) == purgeInflight.end()) return 0;
+    if (purgeStale) return 1;
+
+    purgeDone.wait_for(lock, std::chrono::seconds(purgeWaitT),
+                       [&key] { return purgeInflight.find(key) == purgeInflight.end(); });
+    return (purgeInflight.find(key) == purgeInflight.end()? 0 : 1);
+}
@@ -0,0 +1,39 @@
+// Background purge of cache entries whose origin file changed.
+//
+// With purgeMode=async, XcacheHCheckFile() hands purges to one executor
+// thread instead of unlinking on the open path. The executor unlinks in
+// batches of at most purgeRate entries per second, so that a whole dataset
+// republished at the origin doesn't turn into thousands of unlinks hitting
+// the cache disk and Pfc at once.
+//
+// A file whose purge is queued or running is "pending". Opens of a pending
+// file are routed by purgePending:
+//   stale: serve the cached copy without checking again (default)
+//   wait:  wait up to purgeWait seconds for the purge, then go on as usual
+// A stage-in request of a pending file is held and queued once the purge is
+// done, so that it reads the new data rather than the old.
+
+#include <time.h>
+#include <string>
+
+struct cacheOptions;
+
+void purgeInit(struct cacheOptions *cacheOpts);
+
+// Return
+// 1: purges are done by the executor (purgeMode=async)
+// 0: the caller purges itself
+int purgeAsync();
+
+// queue myPfn for the executor, nothing is done if it is already pending.
+// Return 1 if it was queued, 0 if it was already pending
+int purgeSubmit(std::string myPfn);
+
+// Hold a stage-in request of myPfn (by tenant) until its pending purge is
+// done. Return 1 if held, 0 if the file is not (or no longer) pending
+int purgeHoldStagein(std::string myPfn, const std::string tenant);
+
+// Route an open of myPfn, see purgePending above. Return
+// 1: serve the cached copy, no check
+// 0: not (or no longer) pending, check as usual
+int purgeRoute(std::string myPfn);
@@ -0,0 +1,602 @@
+using namespace std;
+
+#include <math.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/statvfs.h>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+#include <atomic>
+
+#include "XcacheH.hh"
+#include "stagein.hh"
+#include "cacheFileOpr.hh"
+#include "XcacheHLog.hh"
+#include "XrdCl/XrdClURL.hh"
+#include "XrdCl/XrdClXRootDResponses.hh"
+#include "XrdCl/XrdClFile.hh"
+#include "XrdPosix/XrdPosixXrootd.hh"
+
+#define MAXSTAGINWORKERS 10
+#define MAXSTAGINSIZEQUERIES 100  // per round of the size learner
+#define STAGEINSIZETHREADS 8      // size queries at a time
+#define STAGEINSIZEINTERVAL 5     // seconds between rounds of the size learner
+#define STAGEINAGING 600          // seconds of waiting that halve a size for "aged"
+#define STAGEINSIZETRIES 3        // rounds of the size learner that try to learn a size
+#define STAGEINUNKNOWNSIZE (100LL*1024*1024*1024)  // what a file of unknown size counts as
+#define STAGEINBLOCKRETRIES 3
+#define STAGEINREADERFAILURES 3   // failed reads in a row that stop a parallel reader
+#define STAGEINQUANTUM (1024LL*1024*1024)  // bytes a tenant of weight 1 earns per turn
+
+struct stageinReq
+{
+    std::string url;
+    std::string tenant;
+    long long size;  // -1: not known (yet)
+    int sizeTries;   // failed attempts to learn the size
+    time_t qTime;
+};
+
+static size_t cacheBlockSize;
+static int xrdPort;
+static std::string hostName;
+static int stageinLoopback;
+static std::string stageinOrder;
+static std::string stageinDiskPath;
+static double stageinDiskHigh;
+static int stageinStreams;
+static std::map<std::string, int> stageinWeights;
+
+int currStagingWorkers = 0;
+unsigned long stageinIncomplete = 0;  // stage-ins that didn't read every block
+std::map<std::string, std::list<struct stageinReq> > stageinQueues;  // tenant -> its requests
+std::set<std::string> stageinQueued;  // urls in any of the queues
+std::map<std::string, long long> stagingNow;  // url -> size
+std::list<std::string> stageinRound;  // tenants with queued requests, in turn order
+std::map<std::string, long long> stageinDeficit;  // tenant -> bytes earned but not used
+std::mutex stageinMutex;
+
+void addToStageinList(std::string myPfn, const std::string tenant)
+{
+    std::lock_guard<std::mutex> guard(stageinMutex);
+
+    if (stageinQueued.insert(myPfn).second)
+    {
+        struct stageinReq req;
+        req.url = myPfn;
+        req.tenant = tenant;
+        req.size = -1;
+        req.sizeTries = 0;
+        req.qTime = time(NULL);
+        stageinQueues[tenant].push_back(req);
+        if (stageinDeficit.find(tenant) == stageinDeficit.end())
+        {
+            stageinDeficit[tenant] = 0;
+            stageinRound.push_back(tenant);
+        }
+        XcacheHLog(XCACHEH_LOG_INFO, "adding stagein request for %s", myPfn);
+    }
+    else
+        XcacheHLog(XCACHEH_LOG_INFO, "reject stagein request for %s", myPfn);
+}
+
+void sparseReading(std::string localUrl, size_t blockSize)
+{
+    int fd;
+    size_t offset;
+    uint32_t n = 1;
+    char buff[2];
+
+    offset = 0;
+    XrdCl::XRootDStatus myStatus;
+    XrdCl::ResponseHandler myRespHdler;
+
+    XrdCl::File myRmtFile;
+    myStatus = myRmtFile.Open(localUrl.c_str(), XrdCl::OpenFlags::Read, XrdCl::Access::None, uint16_t(0));
+    while (myStatus.status == 0 && n > 0)
+    {
+        myStatus = myRmtFile.Read(offset, 1, (void*)buff, n, uint16_t(0));
+        offset += blockSize;
+    }
+    myStatus = myRmtFile.Close(uint16_t(0));
+}
+
+// Same as sparseReading() but through XrdPosix in this process: Pfc fetches
+// the blocks directly, without a root:// connection back to this server.
+//
+// Return 0 or -1 if not all blocks were read
+int sparseReadingLocal(std::string myPfn, size_t blockSize)
+{
+    struct stat myStat;
+    off_t offset;
+    char buff[2];
+    int fd, rc = 0;
+
+    fd = XrdPosixXrootd::Open(myPfn.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        XcacheHLogNum(XCACHEH_LOG_ERR, "stagein can not open %s, errno %d", myPfn, errno, 0);
+        return -1;
+    }
+
+    if (XrdPosixXrootd::Fstat(fd, &myStat) == 0)
+    {
+        for (offset = 0; offset < myStat.st_size; offset += blockSize)
+            if (XrdPosixXrootd::Pread(fd, buff, 1, offset) < 0)
+            {
+                XcacheHLogNum(XCACHEH_LOG_ERR, "stagein read error at offset %d, errno %d: %s",
+                              myPfn, offset, errno);
+                rc = -1;
+                break;
+            }
+    }
+    else
+    {
+        offset = 0;
+        while (XrdPosixXrootd::Pread(fd, buff, 1, offset) > 0) offset += blockSize;
+    }
+    XrdPosixXrootd::Close(fd);
+    return rc;
+}
+
+// Blocks of one file shared by the readers of sparseReadingParallel()
+struct stageinBlocks
+{
+    size_t blockSize;
+    long long nBlocks;
+    long long next;
+    std::list<long long> failed;      // to be read again, by another reader if possible
+    std::map<long long, int> tries;
+    long long lost;                   // blocks given up after STAGEINBLOCKRETRIES
+    int nReaders;                     // readers still going
+    std::mutex mutex;
+};
+
+// One reader: its own XrdPosix file on one replica
+struct stageinReader
+{
+    std::string url;
+    int fd;
+    int lastFailed;  // the reader's last read failed
+};
+
+// Take the next block: a failed one first, unless this reader just failed
+// (it goes to a reader whose source works). Return -1 if there is nothing
+// left for this reader, which then no longer counts as going.
+static long long sparseNextBlock(struct stageinBlocks *blocks, struct stageinReader *reader)
+{
+    std::lock_guard<std::mutex> guard(blocks->mutex);
+
+    if (! blocks->failed.empty() && (! reader->lastFailed || blocks->nReaders == 1))
+    {
+        long long b = blocks->failed.front();
+        blocks->failed.pop_front();
+        return b;
+    }
+    if (blocks->next < blocks->nBlocks) return blocks->next++;
+    blocks->nReaders--;
+    return -1;
+}
+
+static void sparseReader(struct stageinBlocks *blocks, struct stageinReader *reader)
+{
+    int failures = 0;  // in a row
+    long long b;
+    char buff[2];
+
+    while ((b = sparseNextBlock(blocks, reader)) >= 0)
+    {
+        if (XrdPosixXrootd::Pread(reader->fd, buff, 1, b * blocks->blockSize) >= 0)
+        {
+            failures = reader->lastFailed = 0;
+            continue;
+        }
+
+        failures++;
+        reader->lastFailed = 1;
+        std::lock_guard<std::mutex> guard(blocks->mutex);
+        if (++blocks->tries[b] < STAGEINBLOCKRETRIES)
+            blocks->failed.push_back(b);
+        else
+            blocks->lost++;
+        // this replica is in trouble, leave the rest to the others
+        if (failures >= STAGEINREADERFAILURES && blocks->nReaders > 1)
+        {
+            blocks->nReaders--;
+            XcacheHLogNum(XCACHEH_LOG_ERR, "stagein reader stops after %d failed reads in a row: %s",
+                          reader->url, failures, 0);
+            return;
+        }
+    }
+}
+
+// Same as sparseReadingLocal() with one reader per replica, each on its own
+// XrdPosix file (see XcacheHReplicaUrl()), so that Pfc fetches the blocks a
+// reader asks for from that reader's replica. Readers take the next block
+// as they go, so a slow replica simply does fewer blocks. A failed block
+// goes to another reader; a reader that fails STAGEINREADERFAILURES reads in
+// a row stops, unless it is the last one.
+//
+// Return 0 or -1 if not all blocks were read
+int sparseReadingParallel(std::string myPfn, const std::vector<std::string> &replicas, size_t blockSize)
+{
+    struct stageinBlocks blocks;
+    std::vector<struct stageinReader> readers;
+    std::vector<std::thread> threads;
+    struct stat myStat;
+    size_t i;
+
+    for (i = 0; i < replicas.size(); i++)
+    {
+        struct stageinReader reader;
+        reader.url = XcacheHReplicaUrl(replicas[i], myPfn);
+        reader.lastFailed = 0;
+        reader.fd = XrdPosixXrootd::Open(reader.url.c_str(), O_RDONLY);
+        if (reader.fd >= 0 && (! readers.empty() || XrdPosixXrootd::Fstat(reader.fd, &myStat) == 0))
+        {
+            readers.push_back(reader);
+            continue;
+        }
+        XcacheHLogNum(XCACHEH_LOG_ERR, "stagein can not use replica %s, errno %d", reader.url, errno, 0);
+        if (reader.fd >= 0) XrdPosixXrootd::Close(reader.fd);
+        XcacheHReplicaDone(reader.url);
+    }
+    if (readers.empty()) return sparseReadingLocal(myPfn, blockSize);
+
+    blocks.blockSize = blockSize;
+    blocks.nBlocks = (myStat.st_size + blockSize -1) / blockSize;
+    blocks.next = 0;
+    blocks.lost = 0;
+    blocks.nReaders = readers.size();
+    for (i = 0; i < readers.size(); i++)
+        threads.push_back(std::thread(sparseReader, &blocks, &readers[i]));
+    for (i = 0; i < readers.size(); i++)
+    {
+        threads[i].join();
+        XrdPosixXrootd::Close(readers[i].fd);
+        XcacheHReplicaDone(readers[i].url);
+    }
+
+    blocks.lost += blocks.failed.size() + (blocks.nBlocks - blocks.next);
+    if (blocks.lost == 0) return 0;
+    XcacheHLogNum(XCACHEH_LOG_ERR, "stagein incomplete, %d of %d blocks not read: %s",
+                  myPfn, blocks.lost, blocks.nBlocks);
+    return -1;
+}
+
+void stageinWorker(std::string myPfn)
+{
+    std::vector<std::string> replicas;
+    int rc;
+
+    // To do: check again if the file is fully cached.
+    XcacheHLog(XCACHEH_LOG_INFO, "stagein now: %s", myPfn);
+
+    if (stageinLoopback == 1)
+    {
+        std::string localUrl = "root://" + hostName + ":" + std::to_string(xrdPort) + "//" + myPfn;
+        sparseReading(localUrl, cacheBlockSize);
+        rc = 0;
+    }
+    else if (stageinStreams > 1 && XcacheHReplicas(myPfn, &replicas) > 1)
+    {
+        // one reader per replica, up to stageinStreams
+        if (replicas.size() > (size_t)stageinStreams) replicas.resize(stageinStreams);
+        XcacheHLogNum(XCACHEH_LOG_DBG, "stagein with %d readers: %s", myPfn, replicas.size(), 0);
+        rc = sparseReadingParallel(myPfn, replicas, cacheBlockSize);
+    }
+    else
+        rc = sparseReadingLocal(myPfn, cacheBlockSize);
+
+    XcacheHRefreshDone(myPfn);  // switch to a refreshed file's new copy
+
+    std::lock_guard<std::mutex> guard(stageinMutex);
+    currStagingWorkers--;
+    stagingNow.erase(myPfn);
+
+    if (rc == 0)
+        XcacheHLog(XCACHEH_LOG_INFO, "stagein completed: %s", myPfn);
+    else
+    {
+        stageinIncomplete++;
+        XcacheHLogNum(XCACHEH_LOG_ERR, "stagein incomplete: %s (%d so far)", myPfn, stageinIncomplete, 0);
+    }
+}
+
+// size from the cache if the file is partially cached, otherwise stat
+// the source (through XrdPosix, the same way Pfc will open it), -1 if
+// neither can tell
+static long long stageinSize(std::string myPfn)
+{
+    struct stat myStat;
+
+    if (cacheFileStat(myPfn, &myStat) == 0) return myStat.st_size;
+    if (XrdPosixXrootd::Stat(myPfn.c_str(), &myStat) == 0) return myStat.st_size;
+    return -1;
+}
+
+// What a request counts as for ordering and for the disk watermark. A file
+// of unknown size counts as a large one, not as an empty one: it is ordered
+// last by "small" and only started when there is room for
+// STAGEINUNKNOWNSIZE, or when no other stage-in is running (see
+// stageinFits()).
+static long long stageinCost(const struct stageinReq &req)
+{
+    return (req.size >= 0? req.size : STAGEINUNKNOWNSIZE);
+}
+
+// Whether req may start with room bytes left under the watermark (-1: no
+// limit). A file whose size could not be learned would otherwise wait for
+// STAGEINUNKNOWNSIZE of room, maybe forever, so it may also start alone.
+// Called with stageinMutex held.
+static bool stageinFits(const struct stageinReq &req, long long room)
+{
+    if (room < 0 || stageinCost(req) <= room) return true;
+    return (req.size < 0 && room > 0 && stagingNow.empty());
+}
+
+// one thread of stageinLearnSizes(): stat urls[i] for the next i not taken
+static void stageinSizer(const std::vector<std::string> *urls, std::vector<long long> *sizes,
+                         std::atomic<size_t> *next)
+{
+    size_t i;
+
+    while ((i = (*next)++) < urls->size())
+        (*sizes)[i] = stageinSize((*urls)[i]);
+}
+
+// learn the size of queued files, STAGEINSIZETHREADS at a time and
+// without holding the lock while asking. A size that can't be learned is
+// tried again in the next rounds, up to STAGEINSIZETRIES times.
+static void stageinLearnSizes()
+{
+    std::vector<std::string> urls;
+    std::map<std::string, long long> sizes;
+    std::map<std::string, std::list<struct stageinReq> >::iterator q;
+    std::list<struct stageinReq>::iterator it;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next(0);
+    size_t i;
+
+    {
+        std::lock_guard<std::mutex> guard(stageinMutex);
+        for (q = stageinQueues.begin(); q != stageinQueues.end(); ++q)
+            for (it = q->second.begin(); it != q->second.end() && urls.size() < MAXSTAGINSIZEQUERIES; ++it)
+                if (it->size < 0 && it->sizeTries < STAGEINSIZETRIES) urls.push_back(it->url);
+    }
+    if (urls.empty()) return;
+
+    std::vector<long long> found(urls.size(), -1);
+    for (i = 0; i < STAGEINSIZETHREADS && i < urls.size(); i++)
+        threads.push_back(std::thread(stageinSizer, &urls, &found, &next));
+    for (i = 0; i < threads.size(); i++)
+        threads[i].join();
+    for (i = 0; i < urls.size(); i++)
+        sizes[urls[i]] = found[i];
+
+    std::lock_guard<std::mutex> guard(stageinMutex);
+    for (q = stageinQueues.begin(); q != stageinQueues.end(); ++q)
+        for (it = q->second.begin(); it != q->second.end(); ++it)
+        {
+            if (it->size >= 0 || sizes.find(it->url) == sizes.end()) continue;
+            it->size = sizes[it->url];
+            if (it->size < 0 && ++it->sizeTries == STAGEINSIZETRIES)
+                XcacheHLog(XCACHEH_LOG_INFO, "stagein can not learn the size, starts when no other stage-in runs: %s",
+                           it->url);
+        }
+}
+
+// The size learner has a thread of its own, a slow origin never holds up
+// the scheduler.
+static void stageinSizeOpr()
+{
+    while (! sleep(STAGEINSIZEINTERVAL))
+        stageinLearnSizes();
+}
+
+// Bytes that can still be staged in before stageinDiskHigh is crossed,
+// or -1 if there is no limit. Called with stageinMutex held.
+static long long stageinDiskRoom()
+{
+    struct statvfs fsStat;
+    std::map<std::string, long long>::iterator it;
+    long long total, used;
+
+    if (stageinDiskPath == "" || statvfs(stageinDiskPath.c_str(), &fsStat) != 0) return -1;
+
+    total = (long long)fsStat.f_blocks * fsStat.f_frsize;
+    used = (long long)(fsStat.f_blocks - fsStat.f_bfree) * fsStat.f_frsize;
+    // files being staged count in full, we don't know how much of them is on disk yet
+    for (it = stagingNow.begin(); it != stagingNow.end(); ++it)
+        used += it->second;
+
+    if (used >= total * stageinDiskHigh) return 0;
+    return (long long)(total * stageinDiskHigh) - used;
+}
+
+// The next request of a tenant's queue to start, according to stageinOrder,
+// among those that fit in room (-1: no limit). Called with stageinMutex held.
+static std::list<struct stageinReq>::iterator stageinPickTenant(long long room, std::list<struct stageinReq> &queue)
+{
+    std::list<struct stageinReq>::iterator it, best = queue.end();
+    double score, bestScore = 0;
+    time_t currTime = time(NULL);
+    long long size;
+
+    for (it = queue.begin(); it != queue.end(); ++it)
+    {
+        if (! stageinFits(*it, room)) continue;
+
+        size = stageinCost(*it);
+        if (stageinOrder == "fifo") return it;
+        if (stageinOrder == "aged")
+            score = ldexp((double)size, -(int)((currTime - it->qTime) / STAGEINAGING));
+        else
+            score = size;
+        if (best == queue.end() || score < bestScore)
+        {
+            best = it;
+            bestScore = score;
+        }
+    }
+    return best;
+}
+
+static int stageinWeight(const std::string &tenant)
+{
+    std::map<std::string, int>::iterator it = stageinWeights.find(tenant);
+    return (it != stageinWeights.end()? it->second : 1);
+}
+
+// Skip the turns in which no tenant can start anything: if every tenant
+// needs at least k more quanta for its next file, give each of them k-1
+// quanta at once instead of going round the tenants k-1 times. Who goes
+// first is the same either way. Called with stageinMutex held.
+static void stageinSkipTurns(long long room)
+{
+    std::list<std::string>::iterator t;
+    std::list<struct stageinReq>::iterator it;
+    std::map<std::string, long long> quantum;
+    long long need, turns = -1;
+
+    for (t = stageinRound.begin(); t != stageinRound.end(); ++t)
+    {
+        std::list<struct stageinReq> &queue = stageinQueues[*t];
+        if ((it = stageinPickTenant(room, queue)) == queue.end()) continue;
+
+        quantum[*t] = stageinWeight(*t) * STAGEINQUANTUM;
+        need = stageinCost(*it) - stageinDeficit[*t];
+        need = (need > 0? (need + quantum[*t] -1) / quantum[*t] : 0);
+        if (turns < 0 || need < turns) turns = need;
+    }
+    if (turns <= 1) return;
+
+    std::map<std::string, long long>::iterator q;
+    for (q = quantum.begin(); q != quantum.end(); ++q)
+        stageinDeficit[q->first] += (turns -1) * q->second;
+}
+
+// Deficit round robin across tenants: the tenant at the front of the round
+// keeps its turn while it has earned the size of its next file, otherwise
+// it earns its quantum and goes to the back. A tenant that has nothing
+// left is dropped from the round, with what it earned. The request picked
+// is taken off its queue into req. Called with stageinMutex held.
+//
+// Return 0, or -1 if nothing fits in room
+static int stageinPick(long long room, struct stageinReq *req)
+{
+    std::list<struct stageinReq>::iterator it;
+    std::string tenant;
+    size_t misses = 0;  // tenants in a row with nothing that fits in room
+    bool skipped = false;
+    long long size;
+
+    while (! stageinRound.empty() && misses < stageinRound.size())
+    {
+        tenant = stageinRound.front();
+        std::list<struct stageinReq> &queue = stageinQueues[tenant];
+        if (queue.empty())
+        {
+            stageinRound.pop_front();
+            stageinDeficit.erase(tenant);
+            stageinQueues.erase(tenant);
+            continue;
+        }
+        it = stageinPickTenant(room, queue);
+        if (it == queue.end())
+        {
+            stageinRound.splice(stageinRound.end(), stageinRound, stageinRound.begin());
+            misses++;
+            continue;
+        }
+        misses = 0;
+
+        size = stageinCost(*it);
+        if (size <= stageinDeficit[tenant])
+        {
+            stageinDeficit[tenant] -= size;
+            *req = *it;
+            queue.erase(it);
+            stageinQueued.erase(req->url);
+            return 0;
+        }
+        if (! skipped)
+        {
+            stageinSkipTurns(room);
+            skipped = true;
+            continue;
+        }
+        stageinDeficit[tenant] += stageinWeight(tenant) * STAGEINQUANTUM;
+        stageinRound.splice(stageinRound.end(), stageinRound, stageinRound.begin());
+    }
+    return -1;
+}
+
+void stageinOpr()
+{
+    struct stageinReq req;
+
+    while (! sleep(20))
+    {
+        // lock will be released when going out of the scope
+        std::lock_guard<std::mutex> guard(stageinMutex);
+
+        long long room = stageinDiskRoom();
+        XcacheHLogNum(XCACHEH_LOG_INFO, "stagein list snapshot: available workers: %d, list length: %d", "",
+                      MAXSTAGINWORKERS - currStagingWorkers, stageinQueued.size());
+        XcacheHLogNum(XCACHEH_LOG_DBG, "stagein tenants: %d", "", stageinRound.size(), 0);
+        if (room == 0 && ! stageinQueued.empty())
+            XcacheHLog(XCACHEH_LOG_INFO, "stagein paused, disk usage would cross stageinDiskHigh on %s", stageinDiskPath);
+
+        while (currStagingWorkers < MAXSTAGINWORKERS && ! stageinQueued.empty())
+        {
+            if (stageinPick(room, &req) != 0) break;  // nothing fits under the watermark
+
+            currStagingWorkers++;
+            long long size = stageinCost(req);
+            stagingNow[req.url] = size;
+            if (room > 0) room = (size < room? room - size : 0);
+
+            std::thread newStageinWorker(stageinWorker, req.url);
+            newStageinWorker.detach();
+        }
+    }
+}
+
+void stageinInit(struct cacheOptions *cacheOpts)
+{
+    cacheBlockSize = cacheOpts->blockSize;
+    xrdPort = cacheOpts->xrdPort;
+    hostName = cacheOpts->hostName;
+    stageinLoopback = cacheOpts->stageinLoopback;
+    stageinOrder = cacheOpts->stageinOrder;
+    stageinDiskPath = cacheOpts->stageinDiskPath;
+    stageinDiskHigh = cacheOpts->stageinDiskHigh;
+    stageinStreams = cacheOpts->stageinStreams;
+
+    // tenant:weight,tenant:weight,... (checked by the N2N constructor)
+    std::string w = cacheOpts->stageinWeights;
+    size_t i = 0, j, c;
+    while (i < w.length())
+    {
+        j = w.find(",", i);
+        if (j == std::string::npos) j = w.length();
+        c = w.find(":", i);
+        if (c != std::string::npos && c < j)
+            stageinWeights[w.substr(i, c - i)] = atoi(w.substr(c +1, j - c -1).c_str());
+        i = j +1;
+    }
+
+    std::thread stageinThread(stageinOpr);
+    stageinThread.detach();
+    std::thread sizeThread(stageinSizeOpr);
+    sizeThread.detach();
+}
@@ -0,0 +1,37 @@
+// Stage-in (prestage) of files requested with the "xcachestagein" CGI.
+//
+// Requests are queued and started by a scheduler thread every 20 seconds,
+// at most MAXSTAGINWORKERS at a time, in the order given by stageinOrder:
+//   fifo:  first come first served (default)
+//   small: smallest file first
+//   aged:  smallest file first, but a file's size is halved for every 10
+//          minutes it waits, so big files are not starved
+// Sizes are learned by a thread of their own, several at a time. A file
+// whose size can't be learned counts as a large one (100 GB), and is also
+// started when no other stage-in is running, so it can't wait forever.
+// With stageinDiskPath, a file is only started if the projected usage of
+// that file system (used + files being staged + this file) stays below
+// stageinDiskHigh, so that prestaging doesn't push Pfc into evicting.
+//
+// With stageinStreams > 1, a file with several replicas (known from the
+// origin's metalink, one extra GET per stage-in) is read by one reader per
+// replica, up to stageinStreams. Each reader opens its own replica, the
+// blocks all go to the cache entry of the original url and are shared out
+// as the readers go, so a slow replica does fewer of them. Blocks that still
+// fail after STAGEINBLOCKRETRIES make the stage-in count as incomplete.
+//
+// Requests are queued per tenant (the user@ of the source url), one queue
+// each, and the tenants are served by deficit round robin: each turn a
+// tenant earns weight x STAGEINQUANTUM bytes and starts files as long as it
+// has earned their size. Turns in which nobody could start a file are
+// skipped in one step, a big file doesn't cost a turn per quantum. Weights come from stageinWeights (tenant:weight,...; a tenant
+// not listed weighs 1), so one tenant prestaging a huge dataset can't hold
+// up the small requests of the others. stageinOrder applies within a tenant.
+
+#include <string>
+
+struct cacheOptions;
+
+void stageinInit(struct cacheOptions *cacheOpts);
+
+void addToStageinList(std::string myPfn, const std::string tenant = "");